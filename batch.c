@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "mrspeedup.h"
+#include "stats.h"
+
+/* a pool of decoders or encoders, taken and given back in any number */
+struct BatchSlots {
+    int free;
+    pthread_cond_t freed;
+};
+
+/* the scheduler shared by the workers */
+struct Batch {
+    pthread_mutex_t lock;
+    struct MrSpeedupBatchJob *jobs;
+    size_t count, next, finished;
+    struct BatchSlots decoders, encoders;
+    int encoderCount;
+    int analysisThreads;
+};
+
+static void *batchWorker(void *batchvp);
+static void runBatchJob(struct Batch *batch, struct MrSpeedupBatchJob *bjob);
+static void takeSlots(struct Batch *batch, struct BatchSlots *slots, int count,
+                      struct MrSpeedupBatchJob *bjob);
+static void giveSlots(struct Batch *batch, struct BatchSlots *slots, int count);
+static void writeJobStats(struct MrSpeedupBatchJob *bjob, struct MrSpeedup *job);
+
+/* run a batch. There's a worker thread for each decoder and encoder, so that
+ * while some jobs analyze, others render, and a worker with a job that's
+ * analyzed but waiting for an encoder doesn't hold up the next analysis. */
+int mrspeedupRunBatch(struct MrSpeedupBatchJob *jobs, size_t count,
+                      int decoders, int encoders)
+{
+    struct Batch batch;
+    pthread_t *workers;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i;
+    int workerCount, failed = 0, tmpi;
+
+    if (cpus < 1) cpus = 1;
+    if (decoders < 1) decoders = 1;
+    if (encoders < 1) encoders = 1;
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.decoders.freed, NULL);
+    pthread_cond_init(&batch.encoders.freed, NULL);
+    batch.jobs = jobs;
+    batch.count = count;
+    batch.next = batch.finished = 0;
+    batch.decoders.free = decoders;
+    batch.encoders.free = batch.encoderCount = encoders;
+    batch.analysisThreads = cpus / decoders;
+    if (batch.analysisThreads < 1) batch.analysisThreads = 1;
+
+    workerCount = decoders + encoders;
+    if (workerCount > count) workerCount = count;
+    SF(workers, malloc, NULL, ((workerCount ? workerCount : 1) * sizeof(pthread_t)));
+    for (i = 0; i < workerCount; i++) {
+        if ((tmpi = pthread_create(&workers[i], NULL, batchWorker, &batch))) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(tmpi));
+            exit(1);
+        }
+    }
+    for (i = 0; i < workerCount; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    pthread_cond_destroy(&batch.encoders.freed);
+    pthread_cond_destroy(&batch.decoders.freed);
+    pthread_mutex_destroy(&batch.lock);
+
+    for (i = 0; i < count; i++)
+        if (jobs[i].status != MRSPEEDUP_OK) failed++;
+    return failed;
+}
+
+/* take jobs in order until there are none left */
+static void *batchWorker(void *batchvp)
+{
+    struct Batch *batch = (struct Batch *) batchvp;
+    size_t i;
+
+    while (1) {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next;
+        if (i < batch->count) batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) break;
+
+        runBatchJob(batch, &batch->jobs[i]);
+    }
+
+    return NULL;
+}
+
+/* run a job through its stages, taking a decoder to analyze it and encoders to
+ * render it */
+static void runBatchJob(struct Batch *batch, struct MrSpeedupBatchJob *bjob)
+{
+    struct MrSpeedupOptions options = bjob->options;
+    struct MrSpeedup *job;
+    unsigned long long start = statsNow(), i;
+    const unsigned char *frameSelections;
+    const char *what = "analyzed";
+    int encoders;
+
+    bjob->frames = bjob->keptFrames = 0;
+    bjob->waitSeconds = 0;
+    bjob->rendering = NULL;
+
+    if (options.threads <= 0) options.threads = batch->analysisThreads;
+    if (bjob->statsFile) options.stats = 1;
+    bjob->status = mrspeedupNew(&job, &options);
+    if (bjob->status != MRSPEEDUP_OK) goto done;
+
+    takeSlots(batch, &batch->decoders, 1, bjob);
+    bjob->status = mrspeedupAnalyze(job);
+    giveSlots(batch, &batch->decoders, 1);
+    mrspeedupFrameDiffs(job, &bjob->frames);
+
+    if (bjob->status == MRSPEEDUP_OK && !bjob->analyzeOnly)
+        bjob->status = mrspeedupSelect(job);
+
+    if (bjob->status == MRSPEEDUP_OK && !bjob->analyzeOnly) {
+        encoders = options.encoders;
+        if (encoders < 1) encoders = 1;
+        if (encoders > batch->encoderCount) encoders = batch->encoderCount;
+
+        takeSlots(batch, &batch->encoders, encoders, bjob);
+        bjob->rendering = job;
+        bjob->status = mrspeedupRender(job);
+        bjob->rendering = NULL;
+        giveSlots(batch, &batch->encoders, encoders);
+
+        frameSelections = mrspeedupFrameSelections(job, &i);
+        while (i--)
+            if (!frameSelections[i]) bjob->keptFrames++;
+        what = "done";
+    }
+
+    if (bjob->statsFile) writeJobStats(bjob, job);
+    mrspeedupFree(job);
+
+done:
+    bjob->seconds = (statsNow() - start) / 1e9;
+
+    pthread_mutex_lock(&batch->lock);
+    batch->finished++;
+    if (bjob->status == MRSPEEDUP_OK)
+        fprintf(stderr, "[%zu/%zu] %s: %s, %llu frames in %.1f seconds\n",
+                batch->finished, batch->count, options.inputFile, what,
+                bjob->frames, bjob->seconds);
+    else
+        fprintf(stderr, "[%zu/%zu] %s: %s\n", batch->finished, batch->count,
+                options.inputFile ? options.inputFile : "(no input)",
+                mrspeedupStrerror(bjob->status));
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/* wait for count slots to be free, and take them */
+static void takeSlots(struct Batch *batch, struct BatchSlots *slots, int count,
+                      struct MrSpeedupBatchJob *bjob)
+{
+    unsigned long long start = statsNow();
+
+    pthread_mutex_lock(&batch->lock);
+    while (slots->free < count)
+        pthread_cond_wait(&slots->freed, &batch->lock);
+    slots->free -= count;
+    pthread_mutex_unlock(&batch->lock);
+
+    bjob->waitSeconds += (statsNow() - start) / 1e9;
+}
+
+/* give slots back */
+static void giveSlots(struct Batch *batch, struct BatchSlots *slots, int count)
+{
+    pthread_mutex_lock(&batch->lock);
+    slots->free += count;
+    pthread_cond_broadcast(&slots->freed);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/* write a job's statistics report */
+static void writeJobStats(struct MrSpeedupBatchJob *bjob, struct MrSpeedup *job)
+{
+    FILE *out = stdout;
+
+    if (strcmp(bjob->statsFile, "-") && !(out = fopen(bjob->statsFile, "w"))) {
+        perror(bjob->statsFile);
+        return;
+    }
+    flockfile(out); /* other jobs may be writing theirs to stdout too */
+    if (mrspeedupWriteStats(job, out, bjob->status != MRSPEEDUP_OK) < 0)
+        perror(bjob->statsFile);
+    if (out != stdout) {
+        funlockfile(out);
+        fclose(out);
+    } else {
+        fflush(stdout);
+        funlockfile(out);
+    }
+}
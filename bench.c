@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700 /* for clock_gettime */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arg.h"
+#include "buffer.h"
+#include "diffkernel.h"
+#include "helpers.h"
+#include "selection.h"
+
+/* Microbenchmarks of mrspeedup's hot stages on synthetic data: the frame
+ * difference kernels at several resolutions, and windowing, sorting and
+ * dropping over motion data of growing length. Each measurement repeats
+ * until it has run for the minimum time, and reports the mean. */
+
+#define BENCH_FRAMES 8 /* frames in the kernel's ring, to defeat the cache */
+#define BENCH_STRIDE 4 /* as in adaptive sampling */
+
+BUFFER(res, int);
+
+struct BenchRun {
+    unsigned long long items; /* frames per repetition */
+    size_t itemBytes; /* bytes processed per frame */
+    int reps;
+    double seconds;
+};
+
+void usage();
+double now();
+uint64_t xorshift(uint64_t *state);
+void genFrames(unsigned char **frames, int width, int height, uint64_t seed);
+void genMotion(struct Buffer_double *frameDiffs, unsigned long long count,
+               uint64_t seed);
+void report(const char *stage, const char *size, struct BenchRun *run);
+void benchDiff(int width, int height, double minTime, int sampled,
+               int metric, const char *stage);
+void benchWindow(unsigned long long count, double minTime, int windowSize,
+                 enum WindowKernel windowKernel, const char *stage);
+void benchSort(unsigned long long count, double minTime);
+void benchDrop(unsigned long long count, double minTime, double clipshowDivisor);
+int wantStage(char **stages, int stageCount, const char *stage);
+
+int main(int argc, char **argv)
+{
+    ARG_VARS;
+
+    unsigned long long maxFrames = 1000000, count;
+    double minTime = 0.5, clipshowDivisor = 1;
+    int windowSize = 30;
+    struct Buffer_res resolutions;
+    char **stages;
+    int stageCount = 0;
+    size_t i;
+
+    INIT_BUFFER(resolutions);
+    SF(stages, calloc, NULL, (argc, sizeof(char *)));
+
+    /* read in our arguments */
+    ARG_NEXT();
+    while (argType) {
+        if (argType != ARG_VAL) {
+            ARGN(n, frames) {
+                ARG_GET();
+                maxFrames = atoll(arg);
+            } else ARGN(r, resolution) {
+                int width, height;
+                ARG_GET();
+                if (sscanf(arg, "%dx%d", &width, &height) != 2 ||
+                    width <= 0 || height <= 0) {
+                    usage();
+                    exit(1);
+                }
+                WRITE_ONE_BUFFER(resolutions, width);
+                WRITE_ONE_BUFFER(resolutions, height);
+            } else ARGN(t, time) {
+                ARG_GET();
+                minTime = atof(arg);
+            } else ARGLN(window) {
+                ARG_GET();
+                windowSize = atoi(arg);
+            } else ARGLN(clipshow-divisor) {
+                ARG_GET();
+                clipshowDivisor = atof(arg);
+            } else {
+                usage();
+                exit(1);
+            }
+        } else {
+            stages[stageCount++] = arg;
+        }
+        ARG_NEXT();
+    }
+
+    if (maxFrames < 1000 || windowSize < 1) {
+        usage();
+        exit(1);
+    }
+
+    if (resolutions.bufused == 0) {
+        static const int defaults[] = {854, 480, 1280, 720, 1920, 1080, 3840, 2160};
+        WRITE_BUFFER(resolutions, defaults, sizeof(defaults) / sizeof(int));
+    }
+
+    initFrameDifference();
+    printf("kernels: logdiff %s, sad %s, changed %s\n",
+           frameDifferenceKernel(MOTION_METRIC_LOG_DIFF),
+           frameDifferenceKernel(MOTION_METRIC_SAD),
+           frameDifferenceKernel(MOTION_METRIC_CHANGED));
+    printf("%-18s %12s %8s %14s %12s %14s\n",
+           "stage", "size", "reps", "ns/frame", "MB/s", "frames/s");
+
+    for (i = 0; i < resolutions.bufused; i += 2) {
+        if (wantStage(stages, stageCount, "diff"))
+            benchDiff(resolutions.buf[i], resolutions.buf[i+1], minTime, 0,
+                      MOTION_METRIC_LOG_DIFF, "diff");
+        if (wantStage(stages, stageCount, "sad"))
+            benchDiff(resolutions.buf[i], resolutions.buf[i+1], minTime, 0,
+                      MOTION_METRIC_SAD, "sad");
+        if (wantStage(stages, stageCount, "changed"))
+            benchDiff(resolutions.buf[i], resolutions.buf[i+1], minTime, 0,
+                      MOTION_METRIC_CHANGED, "changed");
+        if (wantStage(stages, stageCount, "sampled"))
+            benchDiff(resolutions.buf[i], resolutions.buf[i+1], minTime, 1,
+                      MOTION_METRIC_LOG_DIFF, "sampled");
+    }
+
+    /* motion data from 1K frames up by factors of 10, for scaling curves */
+    for (count = 1000; count <= maxFrames; count *= 10) {
+        if (wantStage(stages, stageCount, "window")) {
+            benchWindow(count, minTime, windowSize, WINDOW_BOX, "window-box");
+            benchWindow(count, minTime, windowSize, WINDOW_TRIANGLE, "window-triangle");
+            benchWindow(count, minTime, windowSize, WINDOW_EXPONENTIAL, "window-exp");
+        }
+        if (wantStage(stages, stageCount, "sort"))
+            benchSort(count, minTime);
+        if (wantStage(stages, stageCount, "drop"))
+            benchDrop(count, minTime, clipshowDivisor);
+        if (count > maxFrames / 10) break;
+    }
+
+    FREE_BUFFER(resolutions);
+    free(stages);
+    return 0;
+}
+
+void usage()
+{
+    fprintf(stderr, "Use: mrbench [options] [stage...]\n"
+        "Stages: diff sad changed sampled window sort drop. Default all.\n"
+        "Options:\n"
+        "\t-n|--frames <#>\n"
+        "\t\tLongest motion data to benchmark, from 1000 frames up by factors\n"
+        "\t\tof 10. Default 1000000.\n"
+        "\t-r|--resolution <width>x<height>\n"
+        "\t\tBenchmark the difference kernels at this resolution. May be given\n"
+        "\t\tmore than once. Default 854x480, 1280x720, 1920x1080 and\n"
+        "\t\t3840x2160.\n"
+        "\t-t|--time <seconds>\n"
+        "\t\tRun each measurement for at least this long. Default 0.5.\n"
+        "\t--window <#>\n"
+        "\t\tWindow size for the window stage. Default 30.\n"
+        "\t--clipshow-divisor <#>\n"
+        "\t\tClipshow divisor for the drop stage. Default 1.\n");
+}
+
+/* the time in seconds */
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a fast, reproducible pseudorandom number */
+uint64_t xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* make a ring of gray frames of a textured scene panning to the right, with
+ * sensor noise */
+void genFrames(unsigned char **frames, int width, int height, uint64_t seed)
+{
+    unsigned char *scene;
+    int f, x, y;
+
+    SF(scene, malloc, NULL, ((size_t) (width + BENCH_FRAMES * 4) * height));
+    for (y = 0; y < height; y++)
+        for (x = 0; x < width + BENCH_FRAMES * 4; x++)
+            scene[(size_t) y * (width + BENCH_FRAMES * 4) + x] =
+                128 + 60 * sin(x / 17.0) * cos(y / 23.0) + (xorshift(&seed) & 15);
+
+    for (f = 0; f < BENCH_FRAMES; f++) {
+        SF(frames[f], malloc, NULL, ((size_t) width * height));
+        for (y = 0; y < height; y++) {
+            unsigned char *row = scene + (size_t) y * (width + BENCH_FRAMES * 4) + f * 4;
+            for (x = 0; x < width; x++)
+                frames[f][(size_t) y * width + x] = row[x] + (xorshift(&seed) & 3);
+        }
+    }
+
+    free(scene);
+}
+
+/* make motion data shaped like real video's: mostly a steady level of noise,
+ * with bursts of motion and runs of duplicated frames. The diffs are in the
+ * fixed point of the real ones, so there are ties to sort. */
+void genMotion(struct Buffer_double *frameDiffs, unsigned long long count,
+               uint64_t seed)
+{
+    unsigned long long i, burst = 0, still = 0;
+    double level = 20000, diff;
+
+    frameDiffs->bufused = 0;
+    for (i = 0; i < count; i++) {
+        uint64_t r = xorshift(&seed);
+        if (!burst && !still) {
+            if (r % 1000 == 0) burst = 30 + r % 300;
+            else if (r % 1000 == 1) still = 10 + r % 100;
+        }
+
+        if (still) {
+            diff = 0;
+            still--;
+        } else {
+            diff = level * (0.9 + (r >> 40) / (double) (1 << 24) * 0.2);
+            if (burst) {
+                diff *= 20;
+                burst--;
+            }
+        }
+        diff = ldexp(floor(ldexp(diff, DIFF_FRACTION_BITS)), -DIFF_FRACTION_BITS);
+        WRITE_ONE_BUFFER(*frameDiffs, diff);
+    }
+}
+
+/* print a measurement */
+void report(const char *stage, const char *size, struct BenchRun *run)
+{
+    double perFrame = run->seconds / run->reps / run->items;
+    printf("%-18s %12s %8d %14.2f %12.1f %14.0f\n", stage, size, run->reps,
+           perFrame * 1e9, run->itemBytes / perFrame / 1e6, 1 / perFrame);
+    fflush(stdout);
+}
+
+/* a difference kernel, exact or sampled, over consecutive frames */
+void benchDiff(int width, int height, double minTime, int sampled,
+               int metric, const char *stage)
+{
+    struct FrameMetric frameMetric = {metric, 8};
+    unsigned char *frames[BENCH_FRAMES];
+    size_t frameSize = (size_t) width * height;
+    struct BenchRun run;
+    char size[32];
+    volatile double sink = 0;
+    double start;
+    int f;
+
+    genFrames(frames, width, height, 0x9e3779b97f4a7c15ULL);
+
+    run.items = BENCH_FRAMES;
+    run.itemBytes = frameSize;
+    run.reps = 0;
+    start = now();
+    do {
+        for (f = 0; f < BENCH_FRAMES; f++) {
+            const unsigned char *cur = frames[f];
+            const unsigned char *last = frames[(f + BENCH_FRAMES - 1) % BENCH_FRAMES];
+            if (sampled) {
+                unsigned long long ct;
+                double sumSquares;
+                sink += frameDifferenceSampledQ(&frameMetric, cur, last, width, height,
+                                                BENCH_STRIDE, &ct, &sumSquares);
+            } else {
+                sink += frameDifferenceQ(&frameMetric, cur, last, frameSize);
+            }
+        }
+        run.reps++;
+    } while ((run.seconds = now() - start) < minTime);
+
+    snprintf(size, sizeof(size), "%dx%d", width, height);
+    report(stage, size, &run);
+
+    for (f = 0; f < BENCH_FRAMES; f++)
+        free(frames[f]);
+}
+
+/* windowing the motion data. calcWindow works in place, so each repetition
+ * starts from a fresh copy. */
+void benchWindow(unsigned long long count, double minTime, int windowSize,
+                 enum WindowKernel windowKernel, const char *stage)
+{
+    struct Buffer_double source, frameDiffs;
+    struct BenchRun run;
+    char size[32];
+    double start;
+
+    INIT_BUFFER(source);
+    INIT_BUFFER(frameDiffs);
+    genMotion(&source, count, count);
+
+    run.items = count;
+    run.itemBytes = sizeof(double);
+    run.reps = 0;
+    run.seconds = 0;
+    do {
+        frameDiffs.bufused = 0;
+        WRITE_BUFFER(frameDiffs, source.buf, count);
+        start = now();
+        calcWindow(&frameDiffs, windowSize, windowKernel);
+        run.seconds += now() - start;
+        run.reps++;
+    } while (run.seconds < minTime);
+
+    snprintf(size, sizeof(size), "%llu", count);
+    report(stage, size, &run);
+
+    FREE_BUFFER(frameDiffs);
+    FREE_BUFFER(source);
+}
+
+/* making and sorting the frame table */
+void benchSort(unsigned long long count, double minTime)
+{
+    struct Buffer_double source, frameDiffs;
+    struct FrameTable table;
+    struct BenchRun run;
+    char size[32];
+    double start;
+
+    INIT_BUFFER(source);
+    INIT_BUFFER(frameDiffs);
+    genMotion(&source, count, count);
+
+    run.items = count;
+    run.itemBytes = sizeof(double);
+    run.reps = 0;
+    run.seconds = 0;
+    do {
+        frameDiffs.bufused = 0;
+        WRITE_BUFFER(frameDiffs, source.buf, count);
+        start = now();
+        mkFrameTable(&table, &frameDiffs);
+        sortFrameTable(&table);
+        run.seconds += now() - start;
+        freeFrameTable(&table);
+        run.reps++;
+    } while (run.seconds < minTime);
+
+    snprintf(size, sizeof(size), "%llu", count);
+    report("sort", size, &run);
+
+    FREE_BUFFER(frameDiffs);
+    FREE_BUFFER(source);
+}
+
+/* dropping half the frames, as for a 2x speedup. dropFramesf's progress goes
+ * to /dev/null, but is still paid for. */
+void benchDrop(unsigned long long count, double minTime, double clipshowDivisor)
+{
+    struct Buffer_double source, frameDiffs;
+    struct FrameTable table;
+    struct BenchRun run;
+    unsigned char *frameSelections;
+    char size[32];
+    double start;
+    int devNull, savedStderr;
+
+    INIT_BUFFER(source);
+    INIT_BUFFER(frameDiffs);
+    genMotion(&source, count, count);
+    SF(frameSelections, malloc, NULL, (count));
+
+    fflush(stderr);
+    SF(savedStderr, dup, -1, (2));
+    SF(devNull, open, -1, ("/dev/null", O_WRONLY));
+    dup2(devNull, 2);
+
+    run.items = count;
+    run.itemBytes = sizeof(double);
+    run.reps = 0;
+    run.seconds = 0;
+    do {
+        frameDiffs.bufused = 0;
+        WRITE_BUFFER(frameDiffs, source.buf, count);
+        memset(frameSelections, 0, count);
+        mkFrameTable(&table, &frameDiffs);
+        sortFrameTable(&table);
+        start = now();
+        dropFramesf(frameSelections, &table, count / 2, clipshowDivisor);
+        fflush(stderr);
+        run.seconds += now() - start;
+        freeFrameTable(&table);
+        run.reps++;
+    } while (run.seconds < minTime);
+
+    dup2(savedStderr, 2);
+    close(savedStderr);
+    close(devNull);
+
+    snprintf(size, sizeof(size), "%llu", count);
+    report("drop", size, &run);
+
+    free(frameSelections);
+    FREE_BUFFER(frameDiffs);
+    FREE_BUFFER(source);
+}
+
+/* should we run this stage? */
+int wantStage(char **stages, int stageCount, const char *stage)
+{
+    int i;
+    if (!stageCount) return 1;
+    for (i = 0; i < stageCount; i++)
+        if (!strcmp(stages[i], stage)) return 1;
+    return 0;
+}
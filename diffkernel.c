@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIFF_X86 1
+#include <immintrin.h>
+#endif
+
+#include "diffkernel.h"
+
+/* log(i+1) in fixed point, rounded to nearest, so each entry is off by at most
+ * 2^-17 and each pixel's difference by at most 2^-16. Relative to the exact
+ * sum that's not a fixed figure: it's worst for frames that barely change. The
+ * largest entry, log(256), needs 19 bits, so a 32-bit accumulator can take
+ * DIFF_BLOCK of them before it must be widened. */
+static int qlogs[256];
+#define DIFF_BLOCK 8192
+
+/* every kernel takes the threshold, though only the changed-pixel count uses
+ * it */
+typedef unsigned long long (*diffKernel)(const unsigned char *,
+                                         const unsigned char *, size_t, int);
+
+static unsigned long long logScalar(const unsigned char *cur,
+                                    const unsigned char *last, size_t size,
+                                    int threshold);
+static unsigned long long sadScalar(const unsigned char *cur,
+                                    const unsigned char *last, size_t size,
+                                    int threshold);
+static unsigned long long changedScalar(const unsigned char *cur,
+                                        const unsigned char *last, size_t size,
+                                        int threshold);
+#ifdef DIFF_X86
+static unsigned long long logAVX2(const unsigned char *cur,
+                                  const unsigned char *last, size_t size,
+                                  int threshold);
+static unsigned long long sadSSE2(const unsigned char *cur,
+                                  const unsigned char *last, size_t size,
+                                  int threshold);
+static unsigned long long sadAVX2(const unsigned char *cur,
+                                  const unsigned char *last, size_t size,
+                                  int threshold);
+static unsigned long long changedSSE2(const unsigned char *cur,
+                                      const unsigned char *last, size_t size,
+                                      int threshold);
+static unsigned long long changedAVX2(const unsigned char *cur,
+                                      const unsigned char *last, size_t size,
+                                      int threshold);
+#endif
+
+/* indexed by metric. Unknown metrics are treated as log differences, as that
+ * was the only one before metrics were recorded. */
+static diffKernel kernels[MOTION_METRICS] = {
+    logScalar, logScalar, sadScalar, changedScalar
+};
+static const char *kernelNames[MOTION_METRICS] = {
+    "scalar", "scalar", "scalar", "scalar"
+};
+
+void initFrameDifference()
+{
+    int i;
+
+    for (i = 0; i < 256; i++)
+        qlogs[i] = (int) lround(log(i + 1) * (1 << DIFF_FRACTION_BITS));
+
+    /* MRSPEEDUP_KERNEL=scalar forces the fallback, for validation */
+    if (getenv("MRSPEEDUP_KERNEL") && !strcmp(getenv("MRSPEEDUP_KERNEL"), "scalar"))
+        return;
+
+#ifdef DIFF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels[MOTION_METRIC_SAD] = sadSSE2;
+        kernels[MOTION_METRIC_CHANGED] = changedSSE2;
+        kernelNames[MOTION_METRIC_SAD] = kernelNames[MOTION_METRIC_CHANGED] = "sse2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[MOTION_METRIC_UNKNOWN] = kernels[MOTION_METRIC_LOG_DIFF] = logAVX2;
+        kernels[MOTION_METRIC_SAD] = sadAVX2;
+        kernels[MOTION_METRIC_CHANGED] = changedAVX2;
+        for (i = 0; i < MOTION_METRICS; i++)
+            kernelNames[i] = "avx2";
+    }
+#endif
+}
+
+const char *frameDifferenceKernel(int metric)
+{
+    return kernelNames[(metric >= 0 && metric < MOTION_METRICS) ? metric : 0];
+}
+
+unsigned long long frameDifferenceQ(const struct FrameMetric *metric,
+                                    const unsigned char *cur,
+                                    const unsigned char *last, size_t size)
+{
+    int m = (metric->metric >= 0 && metric->metric < MOTION_METRICS) ? metric->metric : 0;
+    return kernels[m](cur, last, size, metric->threshold);
+}
+
+unsigned long long frameDifferenceSampledQ(const struct FrameMetric *metric,
+                                           const unsigned char *cur,
+                                           const unsigned char *last,
+                                           size_t width, size_t height, int stride,
+                                           unsigned long long *count,
+                                           double *sumSquares)
+{
+    unsigned long long sum = 0, ct = 0;
+    double sq = 0;
+    size_t x, y;
+    int m = metric->metric, threshold = metric->threshold;
+
+    for (y = stride / 2; y < height; y += stride) {
+        const unsigned char *curRow = cur + y * width, *lastRow = last + y * width;
+        for (x = stride / 2; x < width; x += stride) {
+            int diff;
+            if (m == MOTION_METRIC_SAD || m == MOTION_METRIC_CHANGED)
+                diff = curRow[x] - lastRow[x];
+            else
+                diff = qlogs[curRow[x]] - qlogs[lastRow[x]];
+            if (diff < 0) diff = -diff;
+            if (m == MOTION_METRIC_CHANGED) diff = (diff > threshold);
+            sum += diff;
+            sq += (double) diff * diff;
+            ct++;
+        }
+    }
+
+    *count = ct;
+    *sumSquares = sq;
+    return sum;
+}
+
+double frameDifferenceUnit(const struct FrameMetric *metric)
+{
+    if (metric->metric == MOTION_METRIC_SAD || metric->metric == MOTION_METRIC_CHANGED)
+        return 1;
+    return ldexp(1, -DIFF_FRACTION_BITS);
+}
+
+double frameDifference(const struct FrameMetric *metric, const unsigned char *cur,
+                       const unsigned char *last, size_t size)
+{
+    return (double) frameDifferenceQ(metric, cur, last, size) *
+        frameDifferenceUnit(metric);
+}
+
+/* portable kernels, also used for the tails of the vector kernels */
+static unsigned long long logScalar(const unsigned char *cur,
+                                    const unsigned char *last, size_t size,
+                                    int threshold)
+{
+    unsigned long long sum = 0;
+    size_t i;
+
+    (void) threshold;
+
+    for (i = 0; i < size; i++) {
+        int diff = qlogs[cur[i]] - qlogs[last[i]];
+        sum += (diff < 0) ? -diff : diff;
+    }
+
+    return sum;
+}
+
+static unsigned long long sadScalar(const unsigned char *cur,
+                                    const unsigned char *last, size_t size,
+                                    int threshold)
+{
+    unsigned long long sum = 0;
+    size_t i;
+
+    (void) threshold;
+
+    for (i = 0; i < size; i++) {
+        int diff = cur[i] - last[i];
+        sum += (diff < 0) ? -diff : diff;
+    }
+
+    return sum;
+}
+
+static unsigned long long changedScalar(const unsigned char *cur,
+                                        const unsigned char *last, size_t size,
+                                        int threshold)
+{
+    unsigned long long count = 0;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        int diff = cur[i] - last[i];
+        count += (((diff < 0) ? -diff : diff) > threshold);
+    }
+
+    return count;
+}
+
+#ifdef DIFF_X86
+/* AVX2: gather eight table entries per frame per step. Integer sums are
+ * associative, so the lane order doesn't change the result. */
+__attribute__((target("avx2")))
+static unsigned long long logAVX2(const unsigned char *cur,
+                                  const unsigned char *last, size_t size,
+                                  int threshold)
+{
+    __m256i sum64 = _mm256_setzero_si256();
+    unsigned long long lanes[4];
+    size_t i = 0, vsize = size & ~(size_t) 7;
+
+    (void) threshold;
+
+    while (i < vsize) {
+        __m256i sum32 = _mm256_setzero_si256();
+        size_t blockEnd = i + DIFF_BLOCK * 8;
+        if (blockEnd > vsize) blockEnd = vsize;
+
+        for (; i < blockEnd; i += 8) {
+            __m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (cur + i)));
+            __m256i l = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (last + i)));
+            c = _mm256_i32gather_epi32(qlogs, c, 4);
+            l = _mm256_i32gather_epi32(qlogs, l, 4);
+            sum32 = _mm256_add_epi32(sum32, _mm256_abs_epi32(_mm256_sub_epi32(c, l)));
+        }
+
+        /* widen this block into the 64-bit sums */
+        sum64 = _mm256_add_epi64(sum64,
+            _mm256_cvtepu32_epi64(_mm256_castsi256_si128(sum32)));
+        sum64 = _mm256_add_epi64(sum64,
+            _mm256_cvtepu32_epi64(_mm256_extracti128_si256(sum32, 1)));
+    }
+
+    _mm256_storeu_si256((__m256i *) lanes, sum64);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+        logScalar(cur + vsize, last + vsize, size - vsize, threshold);
+}
+
+/* SSE2: psadbw sums the absolute differences of eight byte pairs into each
+ * 64-bit lane, so there's nothing to widen */
+__attribute__((target("sse2")))
+static unsigned long long sadSSE2(const unsigned char *cur,
+                                  const unsigned char *last, size_t size,
+                                  int threshold)
+{
+    __m128i sum = _mm_setzero_si128();
+    unsigned long long lanes[2];
+    size_t i, vsize = size & ~(size_t) 15;
+
+    (void) threshold;
+
+    for (i = 0; i < vsize; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *) (cur + i));
+        __m128i l = _mm_loadu_si128((const __m128i *) (last + i));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(c, l));
+    }
+
+    _mm_storeu_si128((__m128i *) lanes, sum);
+    return lanes[0] + lanes[1] + sadScalar(cur + vsize, last + vsize, size - vsize, threshold);
+}
+
+__attribute__((target("avx2")))
+static unsigned long long sadAVX2(const unsigned char *cur,
+                                  const unsigned char *last, size_t size,
+                                  int threshold)
+{
+    __m256i sum = _mm256_setzero_si256();
+    unsigned long long lanes[4];
+    size_t i, vsize = size & ~(size_t) 31;
+
+    (void) threshold;
+
+    for (i = 0; i < vsize; i += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i *) (cur + i));
+        __m256i l = _mm256_loadu_si256((const __m256i *) (last + i));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(c, l));
+    }
+
+    _mm256_storeu_si256((__m256i *) lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+        sadScalar(cur + vsize, last + vsize, size - vsize, threshold);
+}
+
+/* SSE2: a byte's absolute difference is the OR of the two saturating
+ * subtractions, and it's over the threshold if subtracting the threshold
+ * leaves something. Each changed byte becomes a 1, summed by psadbw. */
+__attribute__((target("sse2")))
+static unsigned long long changedSSE2(const unsigned char *cur,
+                                      const unsigned char *last, size_t size,
+                                      int threshold)
+{
+    __m128i sum = _mm_setzero_si128(), zero = _mm_setzero_si128();
+    __m128i thresholds = _mm_set1_epi8((char) threshold), ones = _mm_set1_epi8(1);
+    unsigned long long lanes[2];
+    size_t i, vsize = size & ~(size_t) 15;
+
+    for (i = 0; i < vsize; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *) (cur + i));
+        __m128i l = _mm_loadu_si128((const __m128i *) (last + i));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(c, l), _mm_subs_epu8(l, c));
+        __m128i same = _mm_cmpeq_epi8(_mm_subs_epu8(diff, thresholds), zero);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_andnot_si128(same, ones), zero));
+    }
+
+    _mm_storeu_si128((__m128i *) lanes, sum);
+    return lanes[0] + lanes[1] +
+        changedScalar(cur + vsize, last + vsize, size - vsize, threshold);
+}
+
+__attribute__((target("avx2")))
+static unsigned long long changedAVX2(const unsigned char *cur,
+                                      const unsigned char *last, size_t size,
+                                      int threshold)
+{
+    __m256i sum = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+    __m256i thresholds = _mm256_set1_epi8((char) threshold), ones = _mm256_set1_epi8(1);
+    unsigned long long lanes[4];
+    size_t i, vsize = size & ~(size_t) 31;
+
+    for (i = 0; i < vsize; i += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i *) (cur + i));
+        __m256i l = _mm256_loadu_si256((const __m256i *) (last + i));
+        __m256i diff = _mm256_or_si256(_mm256_subs_epu8(c, l), _mm256_subs_epu8(l, c));
+        __m256i same = _mm256_cmpeq_epi8(_mm256_subs_epu8(diff, thresholds), zero);
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_andnot_si256(same, ones), zero));
+    }
+
+    _mm256_storeu_si256((__m256i *) lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+        changedScalar(cur + vsize, last + vsize, size - vsize, threshold);
+}
+#endif
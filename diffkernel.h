@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DIFFKERNEL_H
+#define DIFFKERNEL_H
+
+#include <stddef.h>
+
+#include "motionfile.h"
+
+/* per-pixel log differences are summed in this many bits of fixed point */
+#define DIFF_FRACTION_BITS 16
+
+/* how frames are compared */
+struct FrameMetric {
+    int metric; /* a MOTION_METRIC_ */
+    int threshold; /* for MOTION_METRIC_CHANGED, the difference a pixel must
+                    * exceed to count as changed, 0 to 255 */
+};
+
+/* set up the log table and choose the best kernels for this CPU */
+void initFrameDifference();
+
+/* the name of the kernel chosen by initFrameDifference for this metric */
+const char *frameDifferenceKernel(int metric);
+
+/* the metric summed over size pixels: |log(cur+1) - log(last+1)| in fixed
+ * point, |cur - last|, or the number of pixels with |cur - last| over the
+ * threshold. Every kernel gives exactly the same result. */
+unsigned long long frameDifferenceQ(const struct FrameMetric *metric,
+                                    const unsigned char *cur,
+                                    const unsigned char *last, size_t size);
+
+/* the same over every stride'th pixel of every stride'th row of a width-wide
+ * frame. Also gives the number of pixels sampled and the sum of their squared
+ * per-pixel values, for estimating the error of the sample. */
+unsigned long long frameDifferenceSampledQ(const struct FrameMetric *metric,
+                                           const unsigned char *cur,
+                                           const unsigned char *last,
+                                           size_t width, size_t height, int stride,
+                                           unsigned long long *count,
+                                           double *sumSquares);
+
+/* what one unit of frameDifferenceQ is as the double stored in motion data */
+double frameDifferenceUnit(const struct FrameMetric *metric);
+
+/* the same, as the double stored in motion data */
+double frameDifference(const struct FrameMetric *metric, const unsigned char *cur,
+                       const unsigned char *last, size_t size);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "framespool.h"
+#include "helpers.h"
+
+static int preadAll(int fd, void *buf, size_t len, off_t off);
+static void discardFrameSpool(struct FrameSpool *spool, const char *why);
+
+/* start a spool */
+int openFrameSpool(struct FrameSpool *spool, const char *dir, size_t frameSize,
+                   unsigned long long maxBytes, int compress)
+{
+    char *path;
+    int fd;
+
+    memset(spool, 0, sizeof(struct FrameSpool));
+    spool->frameSize = frameSize;
+    spool->maxBytes = maxBytes;
+
+#ifndef HAVE_LZ4
+    /* rather than quietly spooling uncompressed */
+    if (compress) {
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+
+    if (!dir) dir = getenv("TMPDIR");
+    if (!dir || !dir[0]) dir = "/tmp";
+    SF(path, malloc, NULL, (strlen(dir) + sizeof("/mrspeedup.XXXXXX")));
+    sprintf(path, "%s/mrspeedup.XXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd < 0) {
+        free(path);
+        return -1;
+    }
+
+    /* nobody else needs to see it, and this way it can't be left behind */
+    unlink(path);
+    free(path);
+    if (!(spool->fd = fdopen(fd, "w+b"))) {
+        close(fd);
+        return -1;
+    }
+
+#ifdef HAVE_LZ4
+    if (compress) {
+        spool->compress = 1;
+        SF(spool->cbuf, malloc, NULL, (LZ4_compressBound(frameSize)));
+        INIT_BUFFER(spool->offsets);
+    }
+#endif
+
+    return 0;
+}
+
+/* whether this build can compress spooled frames */
+int frameSpoolCanCompress()
+{
+#ifdef HAVE_LZ4
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* add a frame to the spool */
+int spoolFrame(struct FrameSpool *spool, const unsigned char *frame)
+{
+    const void *data = frame;
+    uint32_t len = spool->frameSize;
+    size_t size;
+
+    if (spool->overflowed) return -1;
+
+#ifdef HAVE_LZ4
+    if (spool->compress) {
+        len = LZ4_compress_default((const char *) frame, spool->cbuf,
+                                   spool->frameSize, LZ4_compressBound(spool->frameSize));
+        data = spool->cbuf;
+    }
+#endif
+
+    size = len + (spool->compress ? sizeof(len) : 0);
+    if (spool->bytes + size > spool->maxBytes) {
+        discardFrameSpool(spool, "over the size limit");
+        return -1;
+    }
+
+    if (spool->compress) WRITE_ONE_BUFFER(spool->offsets, spool->bytes);
+    if ((spool->compress && fwrite(&len, sizeof(len), 1, spool->fd) != 1) ||
+        fwrite(data, 1, len, spool->fd) != len) {
+        discardFrameSpool(spool, NULL);
+        return -1;
+    }
+
+    spool->bytes += size;
+    spool->frames++;
+    return 0;
+}
+
+/* switch the spool from writing to reading */
+void rewindFrameSpool(struct FrameSpool *spool)
+{
+    if (spool->overflowed) return;
+    if (fflush(spool->fd) != 0) {
+        discardFrameSpool(spool, NULL);
+        return;
+    }
+    seekFrameSpool(spool, 0);
+}
+
+/* continue reading from this frame */
+void seekFrameSpool(struct FrameSpool *spool, unsigned long long frame)
+{
+    if (frame > spool->frames) frame = spool->frames;
+    spool->nextFrame = frame;
+    if (!spool->compress)
+        spool->readOffset = (off_t) frame * spool->frameSize;
+    else if (frame < spool->frames)
+        spool->readOffset = spool->offsets.buf[frame];
+    else
+        spool->readOffset = spool->bytes;
+}
+
+/* read all of this at this offset */
+static int preadAll(int fd, void *buf, size_t len, off_t off)
+{
+    char *cbuf = (char *) buf;
+    ssize_t rd;
+
+    while (len) {
+        rd = pread(fd, cbuf, len, off);
+        if (rd <= 0) return -1;
+        cbuf += rd;
+        len -= rd;
+        off += rd;
+    }
+    return 0;
+}
+
+/* read or skip the next frame */
+int readSpooledFrame(struct FrameSpool *spool, unsigned char *frame)
+{
+    uint32_t len = spool->frameSize;
+
+    int fd;
+    off_t off = spool->readOffset;
+
+    if (spool->overflowed || spool->nextFrame >= spool->frames) return -1;
+    fd = fileno(spool->fd);
+    spool->nextFrame++;
+
+    if (spool->compress) {
+        if (preadAll(fd, &len, sizeof(len), off) < 0) goto fail;
+        off += sizeof(len);
+    }
+    spool->readOffset = off + len;
+
+    /* skipping */
+    if (!frame) return 0;
+
+#ifdef HAVE_LZ4
+    if (spool->compress) {
+        if (preadAll(fd, spool->cbuf, len, off) < 0 ||
+            LZ4_decompress_safe(spool->cbuf, (char *) frame, len, spool->frameSize) !=
+            (int) spool->frameSize)
+            goto fail;
+        return 0;
+    }
+#endif
+
+    if (preadAll(fd, frame, len, off) < 0) goto fail;
+    return 0;
+
+fail:
+    /* we can't decode it again at this point, so this is fatal */
+    fprintf(stderr, "Frame spool is corrupt at frame %llu\n", spool->nextFrame - 1);
+    return -1;
+}
+
+/* discard the spool */
+void closeFrameSpool(struct FrameSpool *spool)
+{
+    if (spool->fd) fclose(spool->fd);
+    free(spool->cbuf);
+    if (spool->compress) FREE_BUFFER(spool->offsets);
+    spool->fd = NULL;
+    spool->cbuf = NULL;
+}
+
+/* give up on spooling, saying why (or errno's reason if NULL) */
+static void discardFrameSpool(struct FrameSpool *spool, const char *why)
+{
+    if (!why) why = strerror(errno);
+    fprintf(stderr, "Discarding the frame spool (%s). The input will be decoded again.\n",
+            why);
+    spool->overflowed = 1;
+    spool->frames = 0;
+    if (spool->fd) fclose(spool->fd);
+    spool->fd = NULL;
+}
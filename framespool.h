@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FRAMESPOOL_H
+#define FRAMESPOOL_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "buffer.h"
+
+/* A frame spool holds the decoded frames of the input in an unlinked
+ * temporary file, so that they can be read back after motion analysis instead
+ * of decoding the input a second time. Frames are stored raw, or compressed
+ * with LZ4 if built with HAVE_LZ4, each preceded by its compressed size. If
+ * the spool would grow beyond its cap, it's discarded. */
+
+#define FRAME_SPOOL_DEFAULT_SIZE (8ULL * 1024 * 1024 * 1024)
+
+BUFFER(offset, off_t);
+
+struct FrameSpool {
+    FILE *fd;
+    size_t frameSize;
+    unsigned long long frames, bytes, maxBytes;
+    int compress;
+    int overflowed;
+    char *cbuf; /* compression buffer */
+    struct Buffer_offset offsets; /* of each compressed frame */
+    unsigned long long nextFrame; /* while reading */
+    off_t readOffset;
+};
+
+/* start a spool in this directory (or $TMPDIR or /tmp if NULL), compressing
+ * it if compress is set. Returns -1 (with errno set) if the spool can't be
+ * created, or can't be compressed in this build. */
+int openFrameSpool(struct FrameSpool *spool, const char *dir, size_t frameSize,
+                   unsigned long long maxBytes, int compress);
+
+/* whether this build can compress spooled frames */
+int frameSpoolCanCompress();
+
+/* add a frame to the spool. Returns -1 if the spool has been discarded. */
+int spoolFrame(struct FrameSpool *spool, const unsigned char *frame);
+
+/* switch the spool from writing to reading, from the first frame */
+void rewindFrameSpool(struct FrameSpool *spool);
+
+/* continue reading from this frame */
+void seekFrameSpool(struct FrameSpool *spool, unsigned long long frame);
+
+/* read the next frame from the spool, or just skip it if frame is NULL.
+ * Returns -1 at the end of the spool, or if the frame can't be read back
+ * (after saying why). Reading doesn't move the file offset, so forked
+ * processes can each read their own part of the spool. */
+int readSpooledFrame(struct FrameSpool *spool, unsigned char *frame);
+
+/* discard the spool */
+void closeFrameSpool(struct FrameSpool *spool);
+
+#endif
@@ -0,0 +1,605 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700 /* for atoll, getline, clock_gettime */
+
+#include <ctype.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arg.h"
+#include "buffer.h"
+#include "mrspeedup.h"
+
+/* options only for the command line */
+struct CliOptions {
+    int motionOnly;
+    char *statsFile;
+    char *batchFile;
+    int batchDecoders, batchEncoders;
+};
+
+BUFFER(charp, char *);
+BUFFER(batchJob, struct MrSpeedupBatchJob);
+
+void usage();
+int readOptions(int argc, char **argv, struct MrSpeedupOptions *options,
+                struct CliOptions *cli);
+int checkOptions(struct MrSpeedupOptions *options, struct CliOptions *cli);
+int runBatch(const struct MrSpeedupOptions *defaults, const struct CliOptions *defaultCli);
+int splitWords(char *line, struct Buffer_charp *words);
+void interrupt(int sig);
+void interruptBatch(int sig);
+
+/* the running job, for interrupt */
+static struct MrSpeedup *volatile runningJob = NULL;
+
+/* the running batch, for interruptBatch */
+static struct MrSpeedupBatchJob *volatile batchJobs = NULL;
+static volatile size_t batchJobCount = 0;
+
+int main(int argc, char **argv)
+{
+    struct MrSpeedupOptions options;
+    struct CliOptions cli;
+    struct MrSpeedup *job;
+    struct sigaction sa;
+    int ret;
+    FILE *statsOut;
+
+    mrspeedupDefaultOptions(&options);
+    memset(&cli, 0, sizeof(cli));
+
+    if ((ret = readOptions(argc, argv, &options, &cli))) {
+        usage();
+        exit(ret > 0 ? 0 : 1);
+    }
+
+    /* in batch mode, they're the defaults for each job */
+    if (cli.batchFile) {
+        if (options.inputFile || cli.statsFile) {
+            usage();
+            exit(1);
+        }
+        return runBatch(&options, &cli) ? 1 : 0;
+    }
+
+    if (checkOptions(&options, &cli) < 0) {
+        usage();
+        exit(1);
+    }
+
+    if (mrspeedupNew(&job, &options) != MRSPEEDUP_OK) exit(1);
+
+    ret = mrspeedupAnalyze(job);
+    if (ret == MRSPEEDUP_OK && !cli.motionOnly) ret = mrspeedupSelect(job);
+    if (ret == MRSPEEDUP_OK && !cli.motionOnly) {
+        /* the output stages aren't in the terminal's process group, so pass
+         * interrupts on to them */
+        runningJob = job;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = interrupt;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGHUP, &sa, NULL);
+
+        ret = mrspeedupRender(job);
+
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        runningJob = NULL;
+    }
+
+    if (cli.statsFile) {
+        statsOut = stdout;
+        if (strcmp(cli.statsFile, "-") && !(statsOut = fopen(cli.statsFile, "w"))) {
+            perror(cli.statsFile);
+        } else {
+            if (mrspeedupWriteStats(job, statsOut, ret != MRSPEEDUP_OK) < 0)
+                perror(cli.statsFile);
+            if (statsOut != stdout) fclose(statsOut);
+            else fflush(stdout);
+        }
+    }
+
+    mrspeedupFree(job);
+    return (ret == MRSPEEDUP_OK) ? 0 : 1;
+}
+
+/* read options from the command line (or a manifest line) on top of those
+ * already given. Returns -1 if they're invalid, or 1 for --help. */
+int readOptions(int argc, char **argv, struct MrSpeedupOptions *options,
+                struct CliOptions *cli)
+{
+    ARG_VARS;
+
+    /* read in our arguments */
+    ARG_NEXT();
+    while (argType) {
+        if (argType != ARG_VAL) {
+            ARGNV(m, motion-file, options->motionFile)
+            ARGV(M, motion-only, cli->motionOnly)
+            ARGLNV(ffmpeg, options->ffmpegCommand)
+            ARGLNV(ffprobe, options->ffprobeCommand)
+            ARGLNV(audio-file, options->audioFile)
+            ARGLNV(mux, options->muxFile)
+            ARGLNV(stats, cli->statsFile)
+            ARGLNV(batch, cli->batchFile)
+            ARGLNV(cache-dir, options->cacheDir)
+            ARGLV(no-cache, options->noCache)
+            ARGLV(single-decode, options->singleDecode)
+            ARGLV(ffmpeg-select, options->ffmpegSelect)
+            ARGLNV(spool-dir, options->spoolDir)
+            ARGLV(spool-lz4, options->spoolCompress)
+            ARGN(s, speedup) {
+                ARG_GET();
+                options->speedup = atoi(arg);
+            } else ARGLN(drop-frames) {
+                ARG_GET();
+                options->dropFrames = atoll(arg);
+            } else ARGLN(keep-frames) {
+                ARG_GET();
+                options->keepFrames = atoll(arg);
+            } else ARGLN(window) {
+                ARG_GET();
+                options->windowSize = atoi(arg);
+            } else ARGLN(cache-size) {
+                ARG_GET();
+                options->cacheSize = atoll(arg) * 1024 * 1024;
+            } else ARGLN(spool-size) {
+                ARG_GET();
+                options->spoolSize = atoll(arg) * 1024 * 1024;
+            } else ARGLN(audio-engine) {
+                ARG_GET();
+                if (!strcmp(arg, "native")) {
+                    options->audioEngine = AUDIO_NATIVE;
+                } else if (!strcmp(arg, "sox")) {
+                    options->audioEngine = AUDIO_SOX;
+                } else {
+                    return -1;
+                }
+            } else ARGLN(metric) {
+                ARG_GET();
+                if (!strcmp(arg, "logdiff")) {
+                    options->metric = MOTION_METRIC_LOG_DIFF;
+                } else if (!strcmp(arg, "sad")) {
+                    options->metric = MOTION_METRIC_SAD;
+                } else if (!strcmp(arg, "changed")) {
+                    options->metric = MOTION_METRIC_CHANGED;
+                } else {
+                    return -1;
+                }
+            } else ARGLN(change-threshold) {
+                ARG_GET();
+                options->metricThreshold = atoi(arg);
+            } else ARGLN(window-kernel) {
+                ARG_GET();
+                if (!strcmp(arg, "box")) {
+                    options->windowKernel = WINDOW_BOX;
+                } else if (!strcmp(arg, "triangle")) {
+                    options->windowKernel = WINDOW_TRIANGLE;
+                } else if (!strcmp(arg, "exponential")) {
+                    options->windowKernel = WINDOW_EXPONENTIAL;
+                } else {
+                    return -1;
+                }
+            } else ARGLN(clipshow-divisor) {
+                ARG_GET();
+                options->clipshowDivisor = atof(arg);
+            } else ARGN(w, width) {
+                ARG_GET();
+                options->width = atoi(arg);
+            } else ARGN(h, height) {
+                ARG_GET();
+                options->height = atoi(arg);
+            } else ARGLN(fps) {
+                ARG_GET();
+                options->fps = atoi(arg);
+            } else ARGN(j, threads) {
+                ARG_GET();
+                options->threads = atoi(arg);
+            } else ARGLN(motion-scale) {
+                ARG_GET();
+                options->motionScale = atoi(arg);
+            } else ARGLN(motion-size) {
+                ARG_GET();
+                if (sscanf(arg, "%dx%d", &options->motionWidth, &options->motionHeight) != 2)
+                    return -1;
+            } else ARGLN(adaptive) {
+                ARG_GET();
+                options->sampleBound = atof(arg);
+            } else ARGLN(checkpoint) {
+                ARG_GET();
+                options->checkpointSeconds = atoi(arg);
+            } else ARGLN(encoders) {
+                ARG_GET();
+                options->encoders = atoi(arg);
+            } else ARGLN(segments) {
+                ARG_GET();
+                options->segments = atoi(arg);
+            } else ARGLN(batch-decoders) {
+                ARG_GET();
+                cli->batchDecoders = atoi(arg);
+            } else ARGLN(batch-encoders) {
+                ARG_GET();
+                cli->batchEncoders = atoi(arg);
+            } else ARG(h, help) {
+                return 1;
+            } else {
+                return -1;
+            }
+        } else if (options->inputFile == NULL) {
+            options->inputFile = arg;
+        } else if (options->outputFile == NULL) {
+            options->outputFile = arg;
+        } else {
+            return -1;
+        }
+
+        ARG_NEXT();
+    }
+
+    return 0;
+
+}
+
+/* check that we have what we need to run a job. Returns -1 if not. */
+int checkOptions(struct MrSpeedupOptions *options, struct CliOptions *cli)
+{
+    if (!options->inputFile) return -1;
+    if (cli->motionOnly) {
+        if (!options->motionFile) options->motionFile = options->outputFile;
+        if (!options->motionFile) return -1;
+        /* nothing is rendered, so there's nothing to spool for */
+        options->singleDecode = 0;
+    } else if (!options->outputFile) {
+        return -1;
+    }
+    if (options->width == 0 || options->height == 0) return -1;
+    if (!cli->motionOnly && 
+        ((!options->speedup && !options->dropFrames && !options->keepFrames) ||
+         (options->speedup && (options->dropFrames || options->keepFrames)) ||
+         (options->dropFrames && (options->speedup || options->keepFrames)) ||
+         (options->keepFrames && (options->speedup || options->dropFrames)))) {
+        return -1;
+    }
+    if (options->motionScale < 1 || options->sampleBound < 0 ||
+        options->metricThreshold < 0 || options->metricThreshold > 255) {
+        return -1;
+    }
+    options->stats = !!cli->statsFile;
+
+    return 0;
+}
+
+/* run the jobs in a batch manifest. Each line has the options and files for a
+ * job, just as on the command line, on top of those given on the command line
+ * itself. Blank lines and comments are skipped. Returns the number of jobs
+ * that failed, or -1 if the manifest is invalid. */
+int runBatch(const struct MrSpeedupOptions *defaults, const struct CliOptions *defaultCli)
+{
+    FILE *manifest;
+    char *line = NULL;
+    size_t lineSize = 0, i;
+    unsigned long long lineNo = 0, frames = 0;
+    struct Buffer_charp lines, words;
+    struct Buffer_batchJob jobs;
+    struct MrSpeedupBatchJob bjob;
+    struct CliOptions cli;
+    struct sigaction sa;
+    struct timespec start, end;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int decoders = defaultCli->batchDecoders, encoders = defaultCli->batchEncoders;
+    int invalid = 0, failed;
+    double seconds;
+
+    if (!(manifest = fopen(defaultCli->batchFile, "r"))) {
+        perror(defaultCli->batchFile);
+        return -1;
+    }
+
+    INIT_BUFFER(lines);
+    INIT_BUFFER(words);
+    INIT_BUFFER(jobs);
+    while (getline(&line, &lineSize, manifest) >= 0) {
+        lineNo++;
+        words.bufused = 0;
+        WRITE_ONE_BUFFER(words, "mrspeedup");
+        if (splitWords(line, &words) < 0) {
+            fprintf(stderr, "%s:%llu: unterminated quote\n", defaultCli->batchFile, lineNo);
+            invalid++;
+            continue;
+        }
+        if (words.bufused == 1) continue;
+        WRITE_ONE_BUFFER(words, NULL);
+
+        memset(&bjob, 0, sizeof(bjob));
+        bjob.options = *defaults;
+        cli = *defaultCli;
+        cli.batchFile = NULL;
+        if (readOptions(words.bufused - 1, words.buf, &bjob.options, &cli) != 0 ||
+            cli.batchFile || checkOptions(&bjob.options, &cli) < 0) {
+            fprintf(stderr, "%s:%llu: invalid job\n", defaultCli->batchFile, lineNo);
+            invalid++;
+            continue;
+        }
+        bjob.analyzeOnly = cli.motionOnly;
+        bjob.statsFile = cli.statsFile;
+        WRITE_ONE_BUFFER(jobs, bjob);
+
+        /* the job's options point into the line, so keep it */
+        WRITE_ONE_BUFFER(lines, line);
+        line = NULL;
+        lineSize = 0;
+    }
+    free(line);
+    fclose(manifest);
+    FREE_BUFFER(words);
+
+    if (invalid) {
+        fprintf(stderr, "Not running the batch; see mrspeedup --help for the options.\n");
+        failed = -1;
+        goto done;
+    }
+
+    /* by default, half the CPUs analyze, and a quarter encode, since x264
+     * uses several each */
+    if (cpus < 1) cpus = 1;
+    if (decoders <= 0) decoders = (cpus > 1) ? cpus / 2 : 1;
+    if (encoders <= 0) encoders = (cpus > 3) ? cpus / 4 : 1;
+
+    /* interrupts stop the whole batch, including the output stages, which
+     * aren't in the terminal's process group */
+    batchJobs = jobs.buf;
+    batchJobCount = jobs.bufused;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = interruptBatch;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    failed = mrspeedupRunBatch(jobs.buf, jobs.bufused, decoders, encoders);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    batchJobCount = 0;
+
+    /* and report how each went */
+    printf("%-8s %10s %10s %9s %9s %10s  %s\n",
+           "status", "frames", "kept", "seconds", "waiting", "frames/s", "input");
+    for (i = 0; i < jobs.bufused; i++) {
+        struct MrSpeedupBatchJob *j = &jobs.buf[i];
+        printf("%-8s %10llu %10llu %9.1f %9.1f %10.1f  %s",
+               (j->status == MRSPEEDUP_OK) ? "ok" : "failed",
+               j->frames, j->keptFrames, j->seconds, j->waitSeconds,
+               (j->seconds > 0) ? j->frames / j->seconds : 0.0,
+               j->options.inputFile);
+        if (j->status != MRSPEEDUP_OK)
+            printf(" (%s)", mrspeedupStrerror(j->status));
+        printf("\n");
+        frames += j->frames;
+    }
+    printf("%zu jobs, %d failed, %llu frames in %.1f seconds, %.1f frames/s\n",
+           jobs.bufused, failed, frames, seconds, (seconds > 0) ? frames / seconds : 0.0);
+
+done:
+    for (i = 0; i < lines.bufused; i++)
+        free(lines.buf[i]);
+    FREE_BUFFER(lines);
+    FREE_BUFFER(jobs);
+    return failed;
+}
+
+/* split a manifest line into words in place, quoted as a shell would for the
+ * simple cases: '...' and "..." quote, and \ escapes the next character. A #
+ * at the start of a word starts a comment. Returns -1 on an unterminated
+ * quote. */
+int splitWords(char *line, struct Buffer_charp *words)
+{
+    char *in = line, *out, quote, c;
+
+    while (1) {
+        while (*in && isspace((unsigned char) *in)) in++;
+        if (!*in || *in == '#') return 0;
+
+        WRITE_ONE_BUFFER(*words, in);
+        out = in;
+        quote = 0;
+        while (*in && (quote || !isspace((unsigned char) *in))) {
+            if (quote && *in == quote) {
+                quote = 0;
+                in++;
+            } else if (!quote && (*in == '\'' || *in == '"')) {
+                quote = *in++;
+            } else {
+                if (*in == '\\' && quote != '\'' && in[1]) in++;
+                *out++ = *in++;
+            }
+        }
+        if (quote) return -1;
+
+        c = *in;
+        *out = '\0';
+        if (c) in++;
+    }
+}
+
+void usage()
+{
+    fprintf(stderr,
+        "Usage: mrspeedup -w <video width> -h <video height>\n"
+        "       {-s <speedup>|--drop-frames <#>|--keep-frames <#>} [options]\n"
+        "       <input video> <output video>\n"
+        "       mrspeedup --batch <manifest> [options]\n"
+        "Flags:\n"
+        "\t-w|--width <video width>\n"
+        "\t\t(Required) Specify video width.\n"
+        "\t-h|--height <video height>\n"
+        "\t\t(Required) Specify video height.\n"
+        "\t-s|--speedup <speedup>\n"
+        "\t\tAverage speedup, used to calculate number of frames to drop.\n"
+        "\t--drop-frames <#>\n"
+        "\t\tAs an alternative to average speedup, precise number of frames to\n"
+        "\t\tdrop.\n"
+        "\t--keep-frames <#>\n"
+        "\t\tSimilar to --drop-frames, but number of frames to keep.\n"
+        "\t-m|--motion-data <file>\n"
+        "\t\tWrite/read motion data to/from the specified file.\n"
+        "\t--checkpoint <seconds>\n"
+        "\t\tWhile calculating motion data, checkpoint it to the motion data\n"
+        "\t\tfile every this many seconds of video. If a run is interrupted,\n"
+        "\t\tthe next run with the same motion data file and input resumes\n"
+        "\t\tfrom the last checkpoint, seeking by the frame rate ffprobe gives.\n"
+        "\t\t0 disables checkpoints. Default 60.\n"
+        "\t--cache-dir <dir>\n"
+        "\t\tCache motion data in this directory, keyed by the input file and\n"
+        "\t\tanalysis parameters. Default $MRSPEEDUP_CACHE, or mrspeedup in\n"
+        "\t\t$XDG_CACHE_HOME or ~/.cache.\n"
+        "\t--cache-size <MB>\n"
+        "\t\tEvict the least recently used cached motion data beyond this\n"
+        "\t\tsize. Default 1024.\n"
+        "\t--no-cache\n"
+        "\t\tDo not cache motion data.\n"
+        "\t-M|--motion-only\n"
+        "\t\tOnly calculate motion data, do not perform speedup. Motion data\n"
+        "\t\twill be written to the motion data file if specified, or the\n"
+        "\t\toutput file which would be used for the video otherwise.\n"
+        "\t--fps <#>\n"
+        "\t\tSpecify video FPS. Default 30.\n"
+        "\t--motion-scale <#>\n"
+        "\t\tCalculate motion data at 1/<#> of the video's width and height.\n"
+        "\t\tffmpeg does the scaling. Default 1.\n"
+        "\t--motion-size <width>x<height>\n"
+        "\t\tCalculate motion data at this resolution.\n"
+        "\t--metric {logdiff|sad|changed}\n"
+        "\t\tHow to measure the motion between frames. \"logdiff\" sums the\n"
+        "\t\tdifferences of the logs of each pixel's luma, \"sad\" sums the\n"
+        "\t\tabsolute differences of the lumas, and \"changed\" counts the\n"
+        "\t\tpixels whose luma changed by more than --change-threshold. sad\n"
+        "\t\tand changed are much faster. Default logdiff.\n"
+        "\t--change-threshold <#>\n"
+        "\t\tFor --metric changed, how much (0 to 255) a pixel's luma must\n"
+        "\t\tchange to count. Default 8.\n"
+        "\t--single-decode\n"
+        "\t\tDecode the input only once, calculating motion data from the\n"
+        "\t\tluma of the same frames that are spooled to a temporary file for\n"
+        "\t\tthe output. Only applies when motion data is calculated, and not\n"
+        "\t\twith --motion-scale, --motion-size or --segments.\n"
+        "\t--ffmpeg-select\n"
+        "\t\tHave ffmpeg drop the frames itself with its select filter, so a\n"
+        "\t\tsingle ffmpeg decodes and encodes the output, and no raw video\n"
+        "\t\tpasses through mrspeedup. Not with --single-decode.\n"
+        "\t--spool-dir <dir>\n"
+        "\t\tDirectory for the --single-decode spool. Default $TMPDIR or /tmp.\n"
+        "\t--spool-size <MB>\n"
+        "\t\tIf the spool would grow beyond this size, discard it and decode\n"
+        "\t\tthe input again for the output. Default 8192.\n"
+        "\t--spool-lz4\n"
+        "\t\tCompress the spool with LZ4, if built with it.\n"
+        "\t--adaptive <error bound>\n"
+        "\t\tEstimate motion data from a sample of 1/16th of the pixels,\n"
+        "\t\tcalculating a frame's motion exactly only if the estimate may be\n"
+        "\t\toff by more than this fraction (e.g. 0.05) of the motion around\n"
+        "\t\tit. Default 0, which always calculates it exactly.\n"
+        "\t-j|--threads <#>\n"
+        "\t\tNumber of threads used to calculate motion data. Default is the\n"
+        "\t\tnumber of online CPUs.\n"
+        "\t--segments <#>\n"
+        "\t\tSplit the input into this many time ranges, each decoded by its\n"
+        "\t\town ffmpeg, to calculate motion data. Requires ffprobe, which\n"
+        "\t\tgives the frame rate to seek by. If the segments don't line up,\n"
+        "\t\tthe input is analyzed in one piece instead. Default 1.\n"
+        "\t--encoders <#>\n"
+        "\t\tSplit the output into this many chunks, each decoded and encoded\n"
+        "\t\tby its own ffmpegs at once, then join them. Each chunk starts with\n"
+        "\t\ta keyframe. Unless the frames are spooled, this requires ffprobe,\n"
+        "\t\tas --segments does, and if the chunks don't line up the output is\n"
+        "\t\tmade in one piece instead. Default 1.\n"
+        "\t--audio-file <file>\n"
+        "\t\tAlso write the input's audio, sped up to match the output video,\n"
+        "\t\tto this file.\n"
+        "\t--mux <file>\n"
+        "\t\tOnce the video and --audio-file are made, mux them together into\n"
+        "\t\tthis file.\n"
+        "\t--stats <file>\n"
+        "\t\tWrite a JSON report of each stage's wall and CPU time, frames per\n"
+        "\t\tsecond, bytes through its pipes and time blocked on them to this\n"
+        "\t\tfile, or - for stdout.\n"
+        "\t--batch <manifest>\n"
+        "\t\tRun a job for each line of the manifest, which has its options\n"
+        "\t\tand files as on the command line, on top of any options given on\n"
+        "\t\tthe command line. Jobs overlap, some analyzing while others\n"
+        "\t\trender, and a table of how each went is printed at the end.\n"
+        "\t\tBlank lines and lines starting with # are skipped.\n"
+        "\t--batch-decoders <#>\n"
+        "\t\tHow many --batch jobs may analyze at once, sharing the CPUs out\n"
+        "\t\tamong them. Default half the number of online CPUs.\n"
+        "\t--batch-encoders <#>\n"
+        "\t\tHow many encoders --batch jobs may run at once. A job with\n"
+        "\t\t--encoders uses that many. Default a quarter of the online CPUs.\n"
+        "\t--audio-engine {native|sox}\n"
+        "\t\tHow to speed up the audio. \"native\" time-stretches it in one\n"
+        "\t\tpass as it streams from ffmpeg, and \"sox\" streams it through a\n"
+        "\t\tsox effects chain. Default native.\n"
+        "\t--ffmpeg <cmd>\n"
+        "\t\tSpecify ffmpeg binary. Default \"ffmpeg\".\n"
+        "\t--ffprobe <cmd>\n"
+        "\t\tSpecify ffprobe binary. Default \"ffprobe\".\n"
+        "\t--window <#>\n"
+        "\t\tNumber of frames in the motion window. Default is 1 (i.e., no\n"
+        "\t\twindow). '0' will select 1/3rd of a second.\n"
+        "\t--window-kernel {box|triangle|exponential}\n"
+        "\t\tShape of the motion window. \"box\" sums the frames in the\n"
+        "\t\twindow, \"triangle\" weights recent frames more heavily, and\n"
+        "\t\t\"exponential\" decays with a time constant of the window size.\n"
+        "\t\tAll have the same total weight. Default box.\n"
+        "\t--clipshow-divisor <#>\n"
+        "\t\tSpecify the \"clipshow divisor\". Larger values put more emphasis\n"
+        "\t\ton keeping frames which are active in the original than on keeping\n"
+        "\t\tan equal amount of action per frame; i.e., it creates a sort of\n"
+        "\t\t\"clip show\". Values less than 1 are valid. 0 is interpreted as\n"
+        "\t\tinfinity, which will give priority ONLY to keeping active frames\n"
+        "\t\tin the original. Default 1.\n");
+}
+
+
+/* pass a signal on to the job's output stages */
+void interrupt(int sig)
+{
+    if (runningJob) mrspeedupInterrupt(runningJob, sig);
+}
+
+/* pass a signal on to every job rendering, then die of it */
+void interruptBatch(int sig)
+{
+    size_t i;
+    struct MrSpeedup *job;
+
+    for (i = 0; i < batchJobCount; i++)
+        if ((job = batchJobs[i].rendering)) mrspeedupInterrupt(job, sig);
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
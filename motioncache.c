@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* for flock */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "motioncache.h"
+
+/* how much of the input we hash to identify it */
+#define CACHE_SAMPLES 16
+#define CACHE_SAMPLE_SIZE 4096
+
+#define CACHE_SUFFIX ".motion"
+
+/* entries are written under this prefix and renamed into place. One older
+ * than this many seconds was left by a process that died while writing it. */
+#define CACHE_TMP_PREFIX ".tmp."
+#define CACHE_TMP_GRACE 3600
+
+struct MotionCacheEntry {
+    char *path;
+    off_t size;
+    struct timespec used;
+};
+
+BUFFER(entry, struct MotionCacheEntry);
+
+static int inputIdentity(const char *inputFile, uint64_t *id);
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len);
+static int mkdirs(const char *dir);
+static int entryUsedCmp(const void *lvp, const void *rvp);
+static void motionCacheEvict(const char *cacheDir, unsigned long long maxSize);
+
+/* the default cache directory */
+char *motionCacheDefaultDir()
+{
+    const char *env;
+    char *dir;
+
+    if ((env = getenv("MRSPEEDUP_CACHE")) && env[0]) {
+        SF(dir, strdup, NULL, (env));
+        return dir;
+    }
+
+    if ((env = getenv("XDG_CACHE_HOME")) && env[0]) {
+        SF(dir, malloc, NULL, (strlen(env) + sizeof("/mrspeedup")));
+        sprintf(dir, "%s/mrspeedup", env);
+        return dir;
+    }
+
+    if ((env = getenv("HOME")) && env[0]) {
+        SF(dir, malloc, NULL, (strlen(env) + sizeof("/.cache/mrspeedup")));
+        sprintf(dir, "%s/.cache/mrspeedup", env);
+        return dir;
+    }
+
+    return NULL;
+}
+
+/* the cache entry for this input and these parameters */
+char *motionCachePath(const char *cacheDir, const char *inputFile,
+                      const struct MotionHeader *params)
+{
+    uint64_t hash, key[9];
+    char *path;
+
+    if (inputIdentity(inputFile, key) < 0) return NULL;
+    key[4] = params->width;
+    key[5] = params->height;
+    key[6] = params->metric;
+    key[7] = MOTION_WIDTH(params);
+    key[8] = MOTION_HEIGHT(params);
+    hash = fnv1a(0xcbf29ce484222325ULL, key, sizeof(key));
+    if (params->sampleBound) /* so exact entries keep their old keys */
+        hash = fnv1a(hash, &params->sampleBound, sizeof(params->sampleBound));
+    if (params->metricThreshold) /* likewise */
+        hash = fnv1a(hash, &params->metricThreshold, sizeof(params->metricThreshold));
+
+    SF(path, malloc, NULL, (strlen(cacheDir) + 18 + sizeof(CACHE_SUFFIX)));
+    sprintf(path, "%s/%016llx" CACHE_SUFFIX, cacheDir, (unsigned long long) hash);
+    return path;
+}
+
+/* identify this input as its cache entries do */
+uint64_t motionInputFingerprint(const char *inputFile)
+{
+    uint64_t id[4];
+
+    if (inputIdentity(inputFile, id) < 0) return 0;
+    return fnv1a(0xcbf29ce484222325ULL, id, sizeof(id));
+}
+
+/* look up a cache entry */
+int motionCacheLoad(struct MotionFile *motion, const char *entry,
+                    const struct MotionHeader *params)
+{
+    int ret = openMotionFile(motion, entry);
+
+    if (ret == -2) {
+        /* a bad entry, get rid of it */
+        unlink(entry);
+        return -1;
+    }
+    if (ret < 0) return -1;
+
+    if (motion->legacy ||
+        motion->header.width != params->width ||
+        motion->header.height != params->height ||
+        MOTION_WIDTH(&motion->header) != MOTION_WIDTH(params) ||
+        MOTION_HEIGHT(&motion->header) != MOTION_HEIGHT(params) ||
+        motion->header.metric != params->metric ||
+        motion->header.metricThreshold != params->metricThreshold ||
+        motion->header.sampleBound != params->sampleBound) {
+        closeMotionFile(motion);
+        return -1;
+    }
+
+    /* mark it as recently used */
+    utimensat(AT_FDCWD, entry, NULL, 0);
+    return 0;
+}
+
+/* store motion data in the cache. Failures are only warnings, since the cache
+ * is just an optimization. */
+void motionCacheStore(const char *cacheDir, const char *entry,
+                      const struct MotionHeader *header, const double *frameDiffs,
+                      unsigned long long maxSize)
+{
+    char *tmpPath;
+    int fd;
+    FILE *out;
+
+    if (mkdirs(cacheDir) < 0) {
+        perror(cacheDir);
+        return;
+    }
+
+    SF(tmpPath, malloc, NULL, (strlen(cacheDir) + sizeof("/" CACHE_TMP_PREFIX "XXXXXX")));
+    sprintf(tmpPath, "%s/" CACHE_TMP_PREFIX "XXXXXX", cacheDir);
+    fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        perror(tmpPath);
+        free(tmpPath);
+        return;
+    }
+
+    if (!(out = fdopen(fd, "wb"))) {
+        close(fd);
+        goto fail;
+    }
+    if (writeMotionStream(out, header, frameDiffs) < 0 ||
+        fflush(out) != 0 || fsync(fd) < 0) {
+        fclose(out);
+        goto fail;
+    }
+    if (fclose(out) != 0) goto fail;
+
+    /* the rename is atomic, so nobody sees a partial entry */
+    if (rename(tmpPath, entry) < 0) goto fail;
+    free(tmpPath);
+
+    motionCacheEvict(cacheDir, maxSize);
+    return;
+
+fail:
+    perror(tmpPath);
+    unlink(tmpPath);
+    free(tmpPath);
+}
+
+/* evict the least recently used entries until the cache fits in maxSize.
+ * Entries still being written count towards the size, and abandoned ones are
+ * removed. */
+static void motionCacheEvict(const char *cacheDir, unsigned long long maxSize)
+{
+    char *lockPath, *path;
+    int lockFd;
+    DIR *dh;
+    struct dirent *de;
+    struct stat sbuf;
+    struct Buffer_entry entries;
+    unsigned long long total = 0;
+    size_t i, suffixLen = strlen(CACHE_SUFFIX), tmpLen = strlen(CACHE_TMP_PREFIX);
+    time_t now = time(NULL);
+
+    SF(lockPath, malloc, NULL, (strlen(cacheDir) + sizeof("/lock")));
+    sprintf(lockPath, "%s/lock", cacheDir);
+    lockFd = open(lockPath, O_RDWR|O_CREAT, 0600);
+    free(lockPath);
+    if (lockFd < 0 || flock(lockFd, LOCK_EX) < 0) {
+        if (lockFd >= 0) close(lockFd);
+        return;
+    }
+
+    INIT_BUFFER(entries);
+    if ((dh = opendir(cacheDir))) {
+        while ((de = readdir(dh))) {
+            size_t len = strlen(de->d_name);
+            struct MotionCacheEntry entry;
+            int tmp = !strncmp(de->d_name, CACHE_TMP_PREFIX, tmpLen);
+            if (!tmp &&
+                (len <= suffixLen || strcmp(de->d_name + len - suffixLen, CACHE_SUFFIX)))
+                continue;
+
+            SF(path, malloc, NULL, (strlen(cacheDir) + len + 2));
+            sprintf(path, "%s/%s", cacheDir, de->d_name);
+            if (stat(path, &sbuf) < 0) {
+                free(path);
+                continue;
+            }
+
+            if (tmp) {
+                if (sbuf.st_mtime < now - CACHE_TMP_GRACE)
+                    unlink(path);
+                else
+                    total += sbuf.st_size;
+                free(path);
+                continue;
+            }
+
+            entry.path = path;
+            entry.size = sbuf.st_size;
+            entry.used = sbuf.st_mtim;
+            WRITE_ONE_BUFFER(entries, entry);
+            total += sbuf.st_size;
+        }
+        closedir(dh);
+    }
+
+    if (total > maxSize) {
+        qsort(entries.buf, entries.bufused, sizeof(struct MotionCacheEntry), entryUsedCmp);
+        for (i = 0; i < entries.bufused && total > maxSize; i++) {
+            if (unlink(entries.buf[i].path) == 0 || errno == ENOENT)
+                total -= entries.buf[i].size;
+        }
+    }
+
+    for (i = 0; i < entries.bufused; i++)
+        free(entries.buf[i].path);
+    FREE_BUFFER(entries);
+
+    flock(lockFd, LOCK_UN);
+    close(lockFd);
+}
+
+/* order cache entries by when they were last used, oldest first */
+static int entryUsedCmp(const void *lvp, const void *rvp)
+{
+    const struct MotionCacheEntry *l = (const struct MotionCacheEntry *) lvp;
+    const struct MotionCacheEntry *r = (const struct MotionCacheEntry *) rvp;
+
+    if (l->used.tv_sec != r->used.tv_sec)
+        return (l->used.tv_sec < r->used.tv_sec) ? -1 : 1;
+    if (l->used.tv_nsec != r->used.tv_nsec)
+        return (l->used.tv_nsec < r->used.tv_nsec) ? -1 : 1;
+    return 0;
+}
+
+/* the four words that identify an input: its size, its modification time, and
+ * a hash of evenly spaced samples of its content. Returns -1 if it isn't a
+ * regular file. */
+static int inputIdentity(const char *inputFile, uint64_t *id)
+{
+    int fd, i;
+    struct stat sbuf;
+    unsigned char *sample;
+    uint64_t hash;
+
+    fd = open(inputFile, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    SF(sample, malloc, NULL, (CACHE_SAMPLE_SIZE));
+    hash = 0xcbf29ce484222325ULL;
+    for (i = 0; i < CACHE_SAMPLES; i++) {
+        off_t off = 0;
+        ssize_t rd;
+        if (sbuf.st_size > CACHE_SAMPLE_SIZE)
+            off = (sbuf.st_size - CACHE_SAMPLE_SIZE) / (CACHE_SAMPLES - 1) * i;
+        rd = pread(fd, sample, CACHE_SAMPLE_SIZE, off);
+        if (rd > 0) hash = fnv1a(hash, sample, rd);
+    }
+    free(sample);
+    close(fd);
+
+    id[0] = sbuf.st_size;
+    id[1] = sbuf.st_mtim.tv_sec;
+    id[2] = sbuf.st_mtim.tv_nsec;
+    id[3] = hash;
+    return 0;
+}
+
+/* FNV-1a over bytes */
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+/* make a directory and any missing parents */
+static int mkdirs(const char *dir)
+{
+    char *path, *slash;
+    int ret = 0;
+
+    if (!dir[0]) return -1;
+    SF(path, strdup, NULL, (dir));
+    for (slash = strchr(path + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash) *slash = '\0';
+        if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+            ret = -1;
+            break;
+        }
+        if (!slash) break;
+        *slash = '/';
+    }
+
+    free(path);
+    return ret;
+}
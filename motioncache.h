@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MOTIONCACHE_H
+#define MOTIONCACHE_H
+
+#include "motionfile.h"
+
+/* Motion data is cached in a directory, one motion file per input and set of
+ * analysis parameters. Entries are written under a temporary name and renamed
+ * into place, so concurrent processes only ever see complete files, and
+ * eviction (least recently used first) is serialized by a lock file. */
+
+#define MOTION_CACHE_DEFAULT_SIZE (1024ULL * 1024 * 1024)
+
+/* the default cache directory, from $MRSPEEDUP_CACHE, $XDG_CACHE_HOME or
+ * $HOME, or NULL if there's none. The result is malloc'd. */
+char *motionCacheDefaultDir();
+
+/* the cache entry for this input and these parameters, or NULL if the input
+ * can't be identified (e.g. it isn't a regular file). The result is malloc'd. */
+char *motionCachePath(const char *cacheDir, const char *inputFile,
+                      const struct MotionHeader *params);
+
+/* identify this input by the same size, modification time and sampled content
+ * as its cache entries are keyed by, or 0 if it can't be identified */
+uint64_t motionInputFingerprint(const char *inputFile);
+
+/* look up a cache entry, checking it matches these parameters. Returns 0 and
+ * opens the motion data on a hit. */
+int motionCacheLoad(struct MotionFile *motion, const char *entry,
+                    const struct MotionHeader *params);
+
+/* store motion data in the cache, then evict entries until the cache is no
+ * larger than maxSize bytes */
+void motionCacheStore(const char *cacheDir, const char *entry,
+                      const struct MotionHeader *header, const double *frameDiffs,
+                      unsigned long long maxSize);
+
+#endif
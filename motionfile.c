@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "motionfile.h"
+
+/* the name of a metric */
+const char *motionMetricName(int metric)
+{
+    switch (metric) {
+        case MOTION_METRIC_LOG_DIFF: return "logdiff";
+        case MOTION_METRIC_SAD: return "sad";
+        case MOTION_METRIC_CHANGED: return "changed";
+        default: return "unknown";
+    }
+}
+
+/* fill in a header for motion data */
+void initMotionHeader(struct MotionHeader *header, unsigned long long frameCount,
+                      int width, int height, int fps, int metric)
+{
+    memset(header, 0, sizeof(struct MotionHeader));
+    memcpy(header->magic, MOTION_MAGIC, sizeof(header->magic));
+    header->version = MOTION_VERSION;
+    header->headerSize = sizeof(struct MotionHeader);
+    header->byteOrder = MOTION_BYTE_ORDER;
+    header->metric = metric;
+    header->frameCount = frameCount;
+    header->width = width;
+    header->height = height;
+    header->fps = fps;
+}
+
+/* FNV-1a over the diffs' 64-bit words */
+uint64_t motionChecksum(const double *frameDiffs, unsigned long long frameCount)
+{
+    return motionChecksumUpdate(0xcbf29ce484222325ULL, frameDiffs, frameCount);
+}
+
+/* continue a checksum over more diffs */
+uint64_t motionChecksumUpdate(uint64_t hash, const double *frameDiffs,
+                              unsigned long long frameCount)
+{
+    uint64_t word;
+    unsigned long long i;
+
+    for (i = 0; i < frameCount; i++) {
+        memcpy(&word, &frameDiffs[i], sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/* FNV-1a over an analyzed frame */
+uint64_t motionFrameHash(const unsigned char *frame, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        hash = (hash ^ frame[i]) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+/* open and validate a motion file */
+int openMotionFile(struct MotionFile *motion, const char *path)
+{
+    int fd;
+    struct stat sbuf;
+    unsigned char *data;
+    size_t size;
+    struct MotionHeader *header;
+
+    memset(motion, 0, sizeof(struct MotionFile));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &sbuf) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    size = sbuf.st_size;
+    data = MAP_FAILED;
+    if (S_ISREG(sbuf.st_mode) && size > 0)
+        data = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    if (data != MAP_FAILED) {
+        motion->mapped = 1;
+
+    } else {
+        /* not something we can map (e.g. a pipe), so read it */
+        struct Buffer_char buf;
+        ssize_t rd;
+        INIT_BUFFER(buf);
+        while ((rd = read(fd, BUFFER_END(buf), BUFFER_SPACE(buf))) > 0) {
+            STEP_BUFFER(buf, rd);
+            if (BUFFER_SPACE(buf) == 0) EXPAND_BUFFER(buf);
+        }
+        if (rd < 0) {
+            int readErrno = errno;
+            FREE_BUFFER(buf);
+            close(fd);
+            errno = readErrno;
+            return -1;
+        }
+        data = (unsigned char *) buf.buf;
+        size = buf.bufused;
+
+    }
+    close(fd);
+
+    motion->map = data;
+    motion->mapSize = size;
+
+    header = (struct MotionHeader *) data;
+    if (size < MOTION_HEADER_V1_SIZE ||
+        memcmp(header->magic, MOTION_MAGIC, sizeof(header->magic))) {
+        /* old format, just doubles */
+        motion->legacy = 1;
+        motion->header.frameCount = size / sizeof(double);
+        motion->frameDiffs = (double *) data;
+        return 0;
+    }
+
+    if (header->byteOrder != MOTION_BYTE_ORDER) {
+        fprintf(stderr, "%s: motion data was written with a different byte order\n", path);
+        goto corrupt;
+    }
+    if (header->version > MOTION_VERSION) {
+        fprintf(stderr, "%s: motion data version %d is newer than this program\n",
+                path, (int) header->version);
+        goto corrupt;
+    }
+    if (header->headerSize % sizeof(double) || header->headerSize > size ||
+        header->headerSize < MOTION_HEADER_V1_SIZE ||
+        header->frameCount > (size - header->headerSize) / sizeof(double)) {
+        fprintf(stderr, "%s: motion data is truncated\n", path);
+        goto corrupt;
+    }
+
+    /* older headers are shorter, and their missing fields are 0 */
+    memcpy(&motion->header, header,
+           (header->headerSize < sizeof(struct MotionHeader)) ?
+           header->headerSize : sizeof(struct MotionHeader));
+
+    motion->frameDiffs = (double *) (data + header->headerSize);
+    if (motionChecksum(motion->frameDiffs, header->frameCount) != header->checksum) {
+        fprintf(stderr, "%s: motion data checksum mismatch\n", path);
+        goto corrupt;
+    }
+
+    return 0;
+
+corrupt:
+    closeMotionFile(motion);
+    return -2;
+}
+
+/* unmap or free a motion file's data */
+void closeMotionFile(struct MotionFile *motion)
+{
+    if (motion->mapped)
+        munmap(motion->map, motion->mapSize);
+    else
+        free(motion->map);
+    motion->map = NULL;
+    motion->frameDiffs = NULL;
+}
+
+/* write motion data with a header to this stream */
+int writeMotionStream(FILE *fd, const struct MotionHeader *header,
+                      const double *frameDiffs)
+{
+    struct MotionHeader out = *header;
+
+    out.checksum = motionChecksum(frameDiffs, out.frameCount);
+    if (fwrite(&out, sizeof(struct MotionHeader), 1, fd) != 1 ||
+        fwrite(frameDiffs, sizeof(double), out.frameCount, fd) != out.frameCount)
+        return -1;
+    return 0;
+}
+
+/* write out motion data with a header */
+int writeMotionFile(const char *path, const struct MotionHeader *header,
+                    const double *frameDiffs)
+{
+    FILE *fd;
+    int err;
+
+    if (!(fd = fopen(path, "wb"))) return -1;
+    if (writeMotionStream(fd, header, frameDiffs) < 0) {
+        err = errno;
+        fclose(fd);
+        errno = err;
+        return -1;
+    }
+    return (fclose(fd) != 0) ? -1 : 0;
+}
+
+/* write all of this at this offset */
+static int pwriteAll(struct MotionWriter *writer, const void *buf, size_t len, off_t off)
+{
+    const char *cbuf = (const char *) buf;
+    ssize_t wr;
+
+    while (len) {
+        wr = pwrite(writer->fd, cbuf, len, off);
+        if (wr < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        cbuf += wr;
+        len -= wr;
+        off += wr;
+    }
+
+    return 0;
+}
+
+/* start writing motion data incrementally */
+int startMotionWriter(struct MotionWriter *writer, const char *path,
+                      const struct MotionHeader *header,
+                      unsigned long long interval)
+{
+    int err;
+
+    writer->path = path;
+    writer->header = *header;
+    writer->interval = interval;
+    writer->error = 0;
+
+    if (header->flags & MOTION_INCOMPLETE) {
+        /* pick up where the last checkpoint left off */
+        if ((writer->fd = open(path, O_RDWR|O_CLOEXEC)) < 0) return -1;
+        if (header->headerSize == sizeof(struct MotionHeader))
+            writer->header.version = MOTION_VERSION;
+
+    } else {
+        if ((writer->fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)) < 0)
+            return -1;
+        writer->header.frameCount = 0;
+        writer->header.flags |= MOTION_INCOMPLETE;
+        writer->header.checksum = motionChecksum(NULL, 0);
+        if (pwriteAll(writer, &writer->header, sizeof(struct MotionHeader), 0) < 0) {
+            err = errno;
+            close(writer->fd);
+            errno = err;
+            return -1;
+        }
+
+    }
+
+    return 0;
+}
+
+/* write out the diffs since the last checkpoint, then the header. Once one
+ * fails, the rest are skipped, and finishMotionWriter reports it. */
+int checkpointMotionWriter(struct MotionWriter *writer, const double *frameDiffs,
+                           unsigned long long frameCount, uint64_t lastFrame)
+{
+    struct MotionHeader *header = &writer->header;
+    unsigned long long from = header->frameCount;
+
+    if (writer->error) {
+        errno = writer->error;
+        return -1;
+    }
+    if (frameCount <= from) return 0;
+
+    if (pwriteAll(writer, frameDiffs + from, (frameCount - from) * sizeof(double),
+                  header->headerSize + from * sizeof(double)) < 0 ||
+        fdatasync(writer->fd) < 0)
+        goto fail;
+
+    header->frameCount = frameCount;
+    header->checksum = motionChecksumUpdate(header->checksum, frameDiffs + from,
+                                            frameCount - from);
+    header->checkpointFrame = lastFrame;
+    if (pwriteAll(writer, header, header->headerSize, 0) < 0 ||
+        fdatasync(writer->fd) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    writer->error = errno;
+    return -1;
+}
+
+/* throw away every checkpoint */
+int rewindMotionWriter(struct MotionWriter *writer)
+{
+    struct MotionHeader *header = &writer->header;
+
+    if (writer->error) {
+        errno = writer->error;
+        return -1;
+    }
+
+    header->frameCount = 0;
+    header->checksum = motionChecksum(NULL, 0);
+    header->checkpointFrame = 0;
+    if (pwriteAll(writer, header, header->headerSize, 0) < 0 ||
+        ftruncate(writer->fd, header->headerSize) < 0 ||
+        fdatasync(writer->fd) < 0) {
+        writer->error = errno;
+        return -1;
+    }
+    return 0;
+}
+
+/* write out the rest of the diffs and mark the file complete */
+int finishMotionWriter(struct MotionWriter *writer, const double *frameDiffs,
+                       unsigned long long frameCount)
+{
+    struct MotionHeader *header = &writer->header;
+
+    if (checkpointMotionWriter(writer, frameDiffs, frameCount, 0) < 0) goto fail;
+
+    header->frameCount = frameCount;
+    header->flags &= ~MOTION_INCOMPLETE;
+    header->checkpointFrame = 0;
+    if (pwriteAll(writer, header, header->headerSize, 0) < 0 ||
+        ftruncate(writer->fd, header->headerSize + frameCount * sizeof(double)) < 0 ||
+        fsync(writer->fd) < 0)
+        goto fail;
+    return close(writer->fd);
+
+fail:
+    writer->error = errno;
+    close(writer->fd);
+    errno = writer->error;
+    return -1;
+}
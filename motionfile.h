@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MOTIONFILE_H
+#define MOTIONFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A motion file is a MotionHeader followed by one double per frame, in the
+ * writer's byte order. Files without the magic are the old format: just the
+ * doubles. */
+#define MOTION_MAGIC "MRSMOTN"
+#define MOTION_VERSION 6
+#define MOTION_BYTE_ORDER 0x01020304
+#define MOTION_HEADER_V1_SIZE 64 /* the shortest header we understand */
+
+/* header flags */
+#define MOTION_INCOMPLETE 1 /* still being written; frameCount is a checkpoint */
+
+enum MotionMetric {
+    MOTION_METRIC_UNKNOWN = 0,
+    MOTION_METRIC_LOG_DIFF = 1, /* sum of |log(cur+1) - log(last+1)| */
+    MOTION_METRIC_SAD = 2, /* sum of |cur - last| */
+    MOTION_METRIC_CHANGED = 3, /* pixels with |cur - last| > metricThreshold */
+    MOTION_METRICS
+};
+
+struct MotionHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize; /* offset of the diffs, a multiple of 8 */
+    uint32_t byteOrder;
+    uint32_t metric;
+    uint64_t frameCount;
+    uint32_t width, height;
+    uint32_t fps;
+    uint32_t flags; /* version 2 */
+    uint64_t checksum; /* of the diffs, see motionChecksum */
+    uint32_t motionWidth, motionHeight; /* analysis resolution, 0 if full */
+    double sampleBound; /* version 3: adaptive sampling error bound, 0 if exact */
+    uint32_t metricThreshold; /* version 4: for MOTION_METRIC_CHANGED */
+    uint32_t reserved;
+    uint64_t inputFingerprint; /* version 5: see motionInputFingerprint, 0 if unknown */
+    uint32_t rateNum, rateDen; /* version 5: the input's frame rate, 0/0 if unknown */
+    uint64_t checkpointFrame; /* version 6: motionFrameHash of the frame whose
+                               * diff is the last checkpointed, 0 if unknown */
+};
+
+/* motion data mapped (or, failing that, read) from a file */
+struct MotionFile {
+    struct MotionHeader header; /* only frameCount is set for old files, and
+                                 * fields past an old header's end are 0 */
+    int legacy;
+    double *frameDiffs;
+    void *map;
+    size_t mapSize;
+    int mapped;
+};
+
+/* motion data being written incrementally, with periodic checkpoints */
+struct MotionWriter {
+    const char *path;
+    int fd;
+    struct MotionHeader header; /* as of the last checkpoint */
+    unsigned long long interval; /* frames between checkpoints, 0 for none */
+    int error; /* errno of the first failed write, or 0 */
+};
+
+/* the name of a metric, as --metric takes it */
+const char *motionMetricName(int metric);
+
+/* fill in a header for motion data */
+void initMotionHeader(struct MotionHeader *header, unsigned long long frameCount,
+                      int width, int height, int fps, int metric);
+
+/* the resolution motion was analyzed at */
+#define MOTION_WIDTH(header) \
+    ((header)->motionWidth ? (header)->motionWidth : (header)->width)
+#define MOTION_HEIGHT(header) \
+    ((header)->motionHeight ? (header)->motionHeight : (header)->height)
+
+/* FNV-1a over the diffs' 64-bit words */
+uint64_t motionChecksum(const double *frameDiffs, unsigned long long frameCount);
+
+/* continue a checksum over more diffs */
+uint64_t motionChecksumUpdate(uint64_t hash, const double *frameDiffs,
+                              unsigned long long frameCount);
+
+/* FNV-1a over an analyzed frame, to recognize it when resuming */
+uint64_t motionFrameHash(const unsigned char *frame, size_t size);
+
+/* open and validate a motion file. Returns -1 (with errno set) if it can't be
+ * opened at all, or -2 (after saying why) if it's corrupt. The diffs are
+ * mapped privately, so they may be modified in memory. */
+int openMotionFile(struct MotionFile *motion, const char *path);
+
+/* unmap or free a motion file's data */
+void closeMotionFile(struct MotionFile *motion);
+
+/* write motion data with a header to this stream. Returns -1 on error. */
+int writeMotionStream(FILE *fd, const struct MotionHeader *header,
+                      const double *frameDiffs);
+
+/* write out motion data with a header. Returns -1 (with errno set) on error. */
+int writeMotionFile(const char *path, const struct MotionHeader *header,
+                    const double *frameDiffs);
+
+/* start writing motion data incrementally. If header is marked incomplete,
+ * this continues the checkpointed file it came from; otherwise it starts a new
+ * one. Returns -1 (with errno set) if the file can't be opened or written. */
+int startMotionWriter(struct MotionWriter *writer, const char *path,
+                      const struct MotionHeader *header,
+                      unsigned long long interval);
+
+/* write out the diffs since the last checkpoint, then the header, syncing
+ * each so that the header never describes data that isn't on disk. lastFrame
+ * is the motionFrameHash of the frame whose diff is last. Returns -1 (with
+ * errno set) on error, after which the writer only waits to be finished. */
+int checkpointMotionWriter(struct MotionWriter *writer, const double *frameDiffs,
+                           unsigned long long frameCount, uint64_t lastFrame);
+
+/* throw away every checkpoint, to start the analysis over. Returns -1 (with
+ * errno set) on error, as checkpointMotionWriter does. */
+int rewindMotionWriter(struct MotionWriter *writer);
+
+/* write out the rest of the diffs, mark the file complete and close it.
+ * Returns -1 (with errno set) if this or any checkpoint failed. */
+int finishMotionWriter(struct MotionWriter *writer, const double *frameDiffs,
+                       unsigned long long frameCount);
+
+#endif
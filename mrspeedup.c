@@ -14,600 +14,1947 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#define _XOPEN_SOURCE 700 /* for atoll, mkdtemp, snprintf */
+#define _XOPEN_SOURCE 700 /* for mkdtemp, snprintf */
+#define _GNU_SOURCE /* for splice, pipe2 and F_SETPIPE_SZ */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include "arg.h"
 #include "buffer.h"
+#include "diffkernel.h"
+#include "framespool.h"
+#include "motioncache.h"
+#include "motionfile.h"
+#include "mrspeedup.h"
+#include "selection.h"
+#include "stats.h"
+#include "stretch.h"
+
+/* one frame in the motion analysis ring */
+struct MotionSlot {
+    unsigned char *frame;
+    int uses; /* diffs still to be computed using this frame */
+    int done; /* its own diff has been computed */
+    double diff;
+};
 
-struct FrameDiff {
-    struct FrameDiff *next;
-    char selection;
-    int frameNo;
-    double frameDiff;
+/* shared state of the motion analysis reader and workers */
+struct MotionPool {
+    pthread_mutex_t lock;
+    pthread_cond_t frameRead, slotDone;
+    struct MotionSlot *slots;
+    int slotCount;
+    size_t frameSize;
+    unsigned char *blankFrame;
+    unsigned long long framesRead, nextFrame;
+    int eof;
+    struct MotionSegment *segment;
+    double scale;
+    struct Buffer_double *scales; /* running scale as of each frame, if sampling */
 };
 
-BUFFER(double, double);
+/* audio is stretched as 16-bit PCM in our byte order */
+#define AUDIO_RATE 48000
+#define AUDIO_CHANNELS 2
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define AUDIO_FORMAT "s16be"
+#else
+#define AUDIO_FORMAT "s16le"
+#endif
+
 BUFFER(charp, char *);
+BUFFER(ull, unsigned long long);
+
+/* Adaptive sampling first estimates each diff from every ADAPTIVE_STRIDE'th
+ * pixel of every ADAPTIVE_STRIDE'th row, and only calculates it exactly if the
+ * estimate's error (ADAPTIVE_Z standard errors) is more than the error bound
+ * times the larger of the estimate and the running scale of motion. The
+ * running scale is an average of the last ADAPTIVE_SCALE_FRAMES or so diffs,
+ * as of ADAPTIVE_LAG frames ago, so that it doesn't depend on which thread
+ * finishes when. */
+#define ADAPTIVE_STRIDE 4
+#define ADAPTIVE_MIN_SAMPLES 64
+#define ADAPTIVE_Z 2.0
+#define ADAPTIVE_SCALE_FRAMES 64
+#define ADAPTIVE_LAG 256
+
+/* a frame rate, as a fraction */
+struct FrameRate {
+    unsigned num, den;
+};
 
-void usage();
-void calcMotionData(struct Buffer_double *frameDiffs, const char *inputFile,
-                    int width, int height);
-void writeMotionData(const char *motionFile, struct Buffer_double *frameDiffs);
+/* what a chunk's decoder saw, to check that the chunks line up. This is in
+ * memory shared with the chunk's process, along with the frames. */
+struct ChunkCheck {
+    int last; /* the last chunk, which must end with the input */
+    int misaligned; /* set if the decoder gave too few or too many frames */
+    unsigned char *first, *next; /* its first frame, and the one after it */
+};
 
-int frameDiffCmp(const struct FrameDiff *l, const struct FrameDiff *r);
-int frameDiffCompare(const void *lvp, const void *rvp);
-int frameDiffBSearch(struct FrameDiff *key, struct FrameDiff **arr, size_t ct);
+/* a time range of the input, decoded by its own ffmpeg for motion analysis */
+struct MotionSegment {
+    const char *ffmpegCommand;
+    const char *inputFile;
+    const char *scale; /* ffmpeg scale filter, or NULL for full size */
+    size_t width, frameSize;
+    size_t frameStride; /* bytes per frame read, of which the first frameSize are diffed */
+    struct FrameMetric metric;
+    struct FrameRate rate; /* of the input, to seek by */
+    int threads;
+    int failed; /* set if its decoder failed */
+    int misaligned; /* set if its first frame wasn't resumeFrame */
+    unsigned long long start, count; /* count 0 means to the end */
+    unsigned long long skip; /* diffs already known, only decoded for context */
+    uint64_t resumeFrame; /* motionFrameHash its first frame must have, or 0 */
+    struct Buffer_double *frameDiffs;
+    struct MotionWriter *writer; /* for checkpoints, or NULL */
+    struct FrameSpool *spool; /* to keep the yuv420p frames read in, or NULL */
+    unsigned char *firstFrame, *lastFrame;
+    double sampleBound; /* adaptive sampling error bound, 0 for exact diffs */
+    unsigned long long estimated, refined; /* adaptive sampling statistics */
+    double errorSum, errorMax;
+    struct StageStats *stats; /* for analysis, or NULL */
+};
 
-void calcWindow(struct Buffer_double *frameDiffs, int windowSize);
-void mkFrameDiffMap(struct FrameDiff ***frameDiffMapPtr, struct Buffer_double *frameDiffs);
-void dropFramesf(unsigned char *frameSelections, unsigned long long frameCount,
-                struct FrameDiff **frameDiffMap, unsigned long long dropFrames,
-                double clipshowDivisor);
-void selectFrames(const char *outputFile, const char *inputFile,
-                  unsigned char *frameSelections,
-                  unsigned long long frameCount,
-                  int width, int height, int fps);
+/* a job, see mrspeedup.h */
+struct MrSpeedup {
+    struct MrSpeedupOptions options;
+    char *cacheDir, *cacheEntry;
+    struct MotionHeader motionHeader;
 
-void mkAudioFile(const char *audioFile, const char *inputFile,
-                 unsigned char *frameSelections, unsigned long long frameCount,
-                 int fps);
+    /* the motion data, which may be mapped from a motion file */
+    struct Buffer_double frameDiffs;
+    struct MotionFile motion;
+    int motionMapped;
+    int analyzed;
 
-char *ffmpegCommand = "ffmpeg";
+    unsigned char *frameSelections; /* once selected */
+    unsigned long long frameCount;
+
+    struct FrameSpool spool, *spoolp;
+    struct StageStats *stats;
+
+    /* the input's frame rate and length, once probed */
+    int probed;
+    struct FrameRate rate; /* 0/0 if unknown */
+    unsigned long long probedFrames; /* 0 if unknown */
 
-int main(int argc, char **argv)
+    /* the process groups of the running output stages, for mrspeedupInterrupt */
+    volatile pid_t stageGroups[2];
+};
+
+static int calcMotionData(struct MrSpeedup *job, struct MotionWriter *writer);
+static int probeInput(struct MrSpeedup *job);
+static void probeVideo(const char *ffprobeCommand, const char *inputFile,
+                       struct FrameRate *rate, unsigned long long *frames);
+static void seekTime(char *buf, size_t size, unsigned long long frame,
+                     const struct FrameRate *rate);
+static int decodeMotionSegment(struct MotionSegment *segment);
+static void *motionSegmentThread(void *segmentvp);
+static void diffFrameStream(struct MotionSegment *segment, FILE *rawData);
+static void segmentDiff(struct MotionSegment *segment, unsigned long long frame, double diff,
+                        const unsigned char *frameData);
+static void *motionWorker(void *poolvp);
+static double adaptiveDifference(struct MotionSegment *segment, const unsigned char *cur,
+                                 const unsigned char *last, double scale,
+                                 int *refined, double *error);
+static void motionScaleUpdate(struct MotionPool *pool);
+
+static int selectFrames(struct MrSpeedup *job);
+static int selectFrameRange(struct MrSpeedup *job, const char *outputFile,
+                            unsigned long long start, unsigned long long count,
+                            struct FrameSpool *spool, int chunk,
+                            struct ChunkCheck *check);
+static int selectFramesFilter(struct MrSpeedup *job);
+static void writeSelectTree(FILE *f, unsigned long long *runs, size_t lo, size_t hi);
+static void growPipe(int fd);
+static int forwardFrame(int in, int out, size_t frameSize, int *useSplice,
+                        unsigned char **buf, struct StageStats *stats);
+static int readFrame(int in, unsigned char *frame, size_t frameSize);
+static int writeFrame(int out, const unsigned char *frame, size_t frameSize);
+static void pollBlocked(int fd, short events, unsigned long long *blocked);
+static int waitChild(pid_t pid, const char *what, struct StageStats *stats);
+static void reapChild(pid_t pid, struct StageStats *stats);
+static pid_t startStage(struct MrSpeedup *job, int (*stage)(struct MrSpeedup *), int *done);
+static int superviseStages(struct MrSpeedup *job, pid_t *pids, int *done,
+                           const char **names, int count);
+static void ignoreSignal(int sig);
+static int renderVideo(struct MrSpeedup *job);
+static int renderAudio(struct MrSpeedup *job);
+static int muxOutput(struct MrSpeedup *job);
+
+static int mkAudioFile(struct MrSpeedup *job);
+static void mkStretchMap(struct Buffer_stretchPoint *map, unsigned char *frameSelections,
+                         unsigned long long frameCount, int fps);
+static int mkAudioFileSox(struct MrSpeedup *job);
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
+/* fill in the default options */
+void mrspeedupDefaultOptions(struct MrSpeedupOptions *options)
 {
-    ARG_VARS;
+    memset(options, 0, sizeof(struct MrSpeedupOptions));
+    options->ffmpegCommand = "ffmpeg";
+    options->ffprobeCommand = "ffprobe";
+    options->fps = 30;
+    options->metric = MOTION_METRIC_LOG_DIFF;
+    options->metricThreshold = 8;
+    options->motionScale = 1;
+    options->segments = 1;
+    options->checkpointSeconds = 60;
+    options->cacheSize = MOTION_CACHE_DEFAULT_SIZE;
+    options->spoolSize = FRAME_SPOOL_DEFAULT_SIZE;
+    options->windowSize = 1;
+    options->windowKernel = WINDOW_BOX;
+    options->clipshowDivisor = 1;
+    options->encoders = 1;
+    options->audioEngine = AUDIO_NATIVE;
+}
 
-    struct Buffer_double frameDiffs;
-    unsigned long long frameCount;
-    struct FrameDiff **frameDiffMap;
-    unsigned char *frameSelections;
-
-    char *inputFile = NULL, *outputFile = NULL, *audioFile = NULL;
-    char *motionFile = NULL;
-    int motionOnly = 0;
-    int width = 0, height = 0;
-    int fps = 30;
-    int windowSize = 1;
-    double clipshowDivisor = 1;
-    /* only one of these should be set */
-    int speedup = 0;
-    unsigned long long dropFrames = 0, keepFrames = 0;
-
-    /* read in our arguments */
-    ARG_NEXT();
-    while (argType) {
-        if (argType != ARG_VAL) {
-            ARGNV(m, motion-file, motionFile)
-            ARGV(M, motion-only, motionOnly)
-            ARGLNV(ffmpeg, ffmpegCommand)
-            ARGLNV(audio-file, audioFile)
-            ARGN(s, speedup) {
-                ARG_GET();
-                speedup = atoi(arg);
-            } else ARGLN(drop-frames) {
-                ARG_GET();
-                dropFrames = atoi(arg);
-            } else ARGLN(keep-frames) {
-                ARG_GET();
-                keepFrames = atoi(arg);
-            } else ARGLN(window) {
-                ARG_GET();
-                windowSize = atoi(arg);
-            } else ARGLN(clipshow-divisor) {
-                ARG_GET();
-                clipshowDivisor = atof(arg);
-            } else ARGN(w, width) {
-                ARG_GET();
-                width = atoi(arg);
-            } else ARGN(h, height) {
-                ARG_GET();
-                height = atoi(arg);
-            } else ARGLN(fps) {
-                ARG_GET();
-                fps = atoi(arg);
-            } else ARG(h, help) {
-                usage();
-                exit(0);
-            } else {
-                usage();
-                exit(1);
-            }
-        } else if (inputFile == NULL) {
-            inputFile = arg;
-        } else if (outputFile == NULL) {
-            outputFile = arg;
-        } else {
-            usage();
-            exit(1);
-        }
+/* make a job, checking that its options make sense together */
+int mrspeedupNew(struct MrSpeedup **jobp, const struct MrSpeedupOptions *options)
+{
+    struct MrSpeedup *job;
+    struct MrSpeedupOptions *opts;
+
+    *jobp = NULL;
+    if (!options->inputFile || options->width <= 0 || options->height <= 0 ||
+        options->fps <= 0 || options->motionScale < 1 || options->sampleBound < 0 ||
+        options->metric <= MOTION_METRIC_UNKNOWN || options->metric >= MOTION_METRICS ||
+        options->metricThreshold < 0 || options->metricThreshold > 255) {
+        fprintf(stderr, "A job needs an input file, its size and frame rate, a motion\n"
+                        "scale of at least 1, a non-negative error bound and a known\n"
+                        "metric with a threshold from 0 to 255.\n");
+        return MRSPEEDUP_EINVAL;
+    }
+    if (options->singleDecode &&
+        (options->motionScale != 1 || options->motionWidth > 0 ||
+         options->motionHeight > 0 || options->segments > 1)) {
+        fprintf(stderr, "--single-decode analyzes the whole input at full size, so it can't\n"
+                        "be used with --motion-scale, --motion-size or --segments.\n");
+        return MRSPEEDUP_EINVAL;
+    }
+    if (options->muxFile && !options->audioFile) {
+        fprintf(stderr, "--mux needs an --audio-file to mux.\n");
+        return MRSPEEDUP_EINVAL;
+    }
+    if (options->singleDecode && options->ffmpegSelect) {
+        fprintf(stderr, "--ffmpeg-select decodes the input itself, so it can't be used with\n"
+                        "--single-decode.\n");
+        return MRSPEEDUP_EINVAL;
+    }
+    if (options->spoolCompress && !frameSpoolCanCompress()) {
+        fprintf(stderr, "This mrspeedup was built without LZ4, so --spool-lz4 is unavailable.\n");
+        return MRSPEEDUP_EINVAL;
+    }
 
-        ARG_NEXT();
+    SF(job, calloc, NULL, (1, sizeof(struct MrSpeedup)));
+    job->options = *options;
+    opts = &job->options;
+
+    if (opts->motionWidth <= 0 || opts->motionHeight <= 0) {
+        opts->motionWidth = opts->width / opts->motionScale;
+        opts->motionHeight = opts->height / opts->motionScale;
+        if (opts->motionWidth < 1) opts->motionWidth = 1;
+        if (opts->motionHeight < 1) opts->motionHeight = 1;
     }
 
-    /* validate arguments */
-    if (!inputFile) {
-        usage();
-        exit(1);
+    if (opts->threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        opts->threads = (cpus > 0) ? cpus : 1;
     }
-    if (motionOnly) {
-        if (!motionFile) motionFile = outputFile;
-        if (!motionFile) {
-            usage();
-            exit(1);
+
+    if (!opts->noCache) {
+        if (opts->cacheDir) {
+            SF(job->cacheDir, strdup, NULL, (opts->cacheDir));
+        } else {
+            job->cacheDir = motionCacheDefaultDir();
         }
-    } else if (!outputFile) {
-        usage();
-        exit(1);
-    }
-    if (width == 0 || height == 0) {
-        usage();
-        exit(1);
     }
-    if (!motionOnly && 
-        ((!speedup && !dropFrames && !keepFrames) ||
-         (speedup && (dropFrames || keepFrames)) ||
-         (dropFrames && (speedup || keepFrames)) ||
-         (keepFrames && (speedup || dropFrames)))) {
-        usage();
-        exit(1);
+
+    if (opts->stats) job->stats = newStats();
+
+    *jobp = job;
+    return MRSPEEDUP_OK;
+}
+
+/* get the motion data, from the motion file if it's there, from the cache if
+ * we've seen this input before, and otherwise by decoding the input */
+int mrspeedupAnalyze(struct MrSpeedup *job)
+{
+    struct MrSpeedupOptions *opts = &job->options;
+    struct MotionFile motionIn, motionCached;
+    struct MotionHeader *motionHeader = &job->motionHeader;
+    struct MotionWriter motionWriter;
+    struct StageStats *stats = statsStage(job->stats, STATS_ANALYZE);
+    const char *motionFile = opts->motionFile;
+    int motionRet = -1, resume = 0, decodeRet;
+
+    if (job->analyzed) return MRSPEEDUP_EORDER;
+
+    /* motion data can be cached, keyed by the input and these parameters */
+    initMotionHeader(motionHeader, 0, opts->width, opts->height, opts->fps, opts->metric);
+    if (opts->metric == MOTION_METRIC_CHANGED)
+        motionHeader->metricThreshold = opts->metricThreshold;
+    if (opts->motionWidth != opts->width || opts->motionHeight != opts->height) {
+        motionHeader->motionWidth = opts->motionWidth;
+        motionHeader->motionHeight = opts->motionHeight;
     }
+    motionHeader->sampleBound = opts->sampleBound;
+    if (motionFile)
+        motionHeader->inputFingerprint = motionInputFingerprint(opts->inputFile);
+    if (job->cacheDir && !job->cacheEntry)
+        job->cacheEntry = motionCachePath(job->cacheDir, opts->inputFile, motionHeader);
 
     /* first step is to get the motion data */
-    INIT_BUFFER(frameDiffs);
-    if (motionFile) {
-        FILE *motionIn = fopen(motionFile, "rb");
-        if (motionIn) {
-            /* motion data already present, read it in */
-            READ_FILE_BUFFER(frameDiffs, motionIn);
-            fclose(motionIn);
+    if (motionFile && (motionRet = openMotionFile(&motionIn, motionFile)) == 0) {
+        if (!motionIn.legacy &&
+            (motionIn.header.width != opts->width || motionIn.header.height != opts->height)) {
+            fprintf(stderr, "%s was calculated at %dx%d\n", motionFile,
+                    (int) motionIn.header.width, (int) motionIn.header.height);
+            if (motionIn.header.flags & MOTION_INCOMPLETE) {
+                closeMotionFile(&motionIn);
+                return MRSPEEDUP_EMOTION;
+            }
+        }
+        if ((motionIn.header.flags & MOTION_INCOMPLETE) &&
+            (MOTION_WIDTH(&motionIn.header) != opts->motionWidth ||
+             MOTION_HEIGHT(&motionIn.header) != opts->motionHeight)) {
+            fprintf(stderr, "%s was being analyzed at %dx%d\n", motionFile,
+                    (int) MOTION_WIDTH(&motionIn.header),
+                    (int) MOTION_HEIGHT(&motionIn.header));
+            closeMotionFile(&motionIn);
+            return MRSPEEDUP_EMOTION;
+        }
+        if (!motionIn.legacy && motionIn.header.metric != MOTION_METRIC_UNKNOWN &&
+            (motionIn.header.metric != motionHeader->metric ||
+             motionIn.header.metricThreshold != motionHeader->metricThreshold)) {
+            fprintf(stderr, "%s was calculated with --metric %s\n", motionFile,
+                    motionMetricName(motionIn.header.metric));
+            if (motionIn.header.flags & MOTION_INCOMPLETE) {
+                closeMotionFile(&motionIn);
+                return MRSPEEDUP_EMOTION;
+            }
+        }
+        if ((motionIn.header.flags & MOTION_INCOMPLETE) &&
+            motionIn.header.sampleBound != opts->sampleBound) {
+            fprintf(stderr, "%s was being analyzed with --adaptive %g\n", motionFile,
+                    motionIn.header.sampleBound);
+            closeMotionFile(&motionIn);
+            return MRSPEEDUP_EMOTION;
+        }
+        resume = !!(motionIn.header.flags & MOTION_INCOMPLETE);
+
+        /* resuming seeks into the input, so it has to be the same input, and
+         * we have to know its exact frame rate */
+        if (resume && (!motionIn.header.inputFingerprint ||
+                       motionIn.header.inputFingerprint != motionHeader->inputFingerprint)) {
+            fprintf(stderr, "%s was not checkpointed from %s\n", motionFile, opts->inputFile);
+            closeMotionFile(&motionIn);
+            return MRSPEEDUP_EMOTION;
+        }
+        if (resume && motionIn.header.frameCount) {
+            if (!motionIn.header.checkpointFrame) {
+                fprintf(stderr, "%s does not record the frame it was checkpointed at,\n"
+                                "starting its motion analysis over.\n", motionFile);
+                closeMotionFile(&motionIn);
+                motionRet = -1;
+                resume = 0;
+            } else if (!motionIn.header.rateNum || probeInput(job) < 0) {
+                fprintf(stderr, "Could not determine the frame rate of %s to resume %s,\n"
+                                "starting its motion analysis over.\n",
+                        opts->inputFile, motionFile);
+                closeMotionFile(&motionIn);
+                motionRet = -1;
+                resume = 0;
+            } else if ((unsigned long long) motionIn.header.rateNum * job->rate.den !=
+                       (unsigned long long) job->rate.num * motionIn.header.rateDen) {
+                fprintf(stderr, "%s was checkpointed at %u/%u frames per second, but %s is\n"
+                                "%u/%u.\n", motionFile,
+                        (unsigned) motionIn.header.rateNum, (unsigned) motionIn.header.rateDen,
+                        opts->inputFile, job->rate.num, job->rate.den);
+                closeMotionFile(&motionIn);
+                return MRSPEEDUP_EMOTION;
+            }
+        }
+    } else if (motionRet == -2) {
+        /* don't overwrite motion data we couldn't read */
+        return MRSPEEDUP_EMOTION;
+    }
 
-        } else {
-            /* read it from the input file */
-            calcMotionData(&frameDiffs, inputFile, width, height);
+    if (motionRet == 0 && !resume) {
+        /* motion data already present, use it in place */
+        job->motion = motionIn;
+        job->motionMapped = 1;
+
+    } else if (job->cacheEntry &&
+               motionCacheLoad(&motionCached, job->cacheEntry, motionHeader) == 0) {
+        /* we've seen this input before */
+        fprintf(stderr, "Using cached motion data %s\n", job->cacheEntry);
+        if (resume) closeMotionFile(&motionIn);
+        if (motionFile &&
+            writeMotionFile(motionFile, &motionCached.header, motionCached.frameDiffs) < 0) {
+            perror(motionFile);
+            closeMotionFile(&motionCached);
+            return MRSPEEDUP_EMOTION;
+        }
+        job->motion = motionCached;
+        job->motionMapped = 1;
+
+    } else {
+        INIT_BUFFER(job->frameDiffs);
+
+        /* write it out as we go, continuing from any checkpoint */
+        if (motionFile) {
+            if (resume) {
+                WRITE_BUFFER(job->frameDiffs, motionIn.frameDiffs, motionIn.header.frameCount);
+                motionRet = startMotionWriter(&motionWriter, motionFile, &motionIn.header,
+                                              opts->checkpointSeconds * opts->fps);
+                closeMotionFile(&motionIn);
+            } else {
+                /* record the frame rate, so that a resumed analysis can seek
+                 * exactly */
+                if (opts->checkpointSeconds > 0 && probeInput(job) == 0) {
+                    motionHeader->rateNum = job->rate.num;
+                    motionHeader->rateDen = job->rate.den;
+                }
+                motionRet = startMotionWriter(&motionWriter, motionFile, motionHeader,
+                                              opts->checkpointSeconds * opts->fps);
+            }
+            if (motionRet < 0) {
+                perror(motionFile);
+                FREE_BUFFER(job->frameDiffs);
+                return MRSPEEDUP_EMOTION;
+            }
+        }
 
-            /* and write it out */
-            writeMotionData(motionFile, &frameDiffs);
+        /* keep the decoded frames for selection if we're only decoding once.
+         * A resumed analysis doesn't decode them all, so can't. */
+        if (opts->singleDecode && !resume) {
+            if (openFrameSpool(&job->spool, opts->spoolDir,
+                               opts->width * opts->height * 6 / 4,
+                               opts->spoolSize, opts->spoolCompress) == 0)
+                job->spoolp = &job->spool;
+            else
+                perror("frame spool");
+        }
 
+        /* read it from the input file */
+        statsStart(stats);
+        decodeRet = calcMotionData(job, motionFile ? &motionWriter : NULL);
+        statsStop(stats);
+        STATS_ADD(stats, frames, job->frameDiffs.bufused);
+        if (decodeRet < 0) {
+            /* leave the motion file at its last checkpoint, so that a run
+             * that can decode the input resumes it */
+            fprintf(stderr, "Could not decode %s\n", opts->inputFile);
+            if (motionFile) close(motionWriter.fd);
+            FREE_BUFFER(job->frameDiffs);
+            return MRSPEEDUP_EINPUT;
         }
+        if (job->spoolp) rewindFrameSpool(job->spoolp);
+        motionHeader->frameCount = job->frameDiffs.bufused;
+
+        if (motionFile &&
+            finishMotionWriter(&motionWriter, job->frameDiffs.buf, job->frameDiffs.bufused) < 0) {
+            perror(motionFile);
+            FREE_BUFFER(job->frameDiffs);
+            return MRSPEEDUP_EMOTION;
+        }
+        if (!job->frameDiffs.bufused) {
+            fprintf(stderr, "No frames could be decoded from %s\n", opts->inputFile);
+            FREE_BUFFER(job->frameDiffs);
+            return MRSPEEDUP_EINPUT;
+        }
+        if (job->cacheEntry)
+            motionCacheStore(job->cacheDir, job->cacheEntry, motionHeader,
+                             job->frameDiffs.buf, opts->cacheSize);
 
-    } else {
-        calcMotionData(&frameDiffs, inputFile, width, height);
+    }
 
+    if (job->motionMapped) {
+        job->frameDiffs.buf = job->motion.frameDiffs;
+        job->frameDiffs.bufsz = job->frameDiffs.bufused = job->motion.header.frameCount;
     }
+    job->frameCount = job->frameDiffs.bufused;
+    job->analyzed = 1;
+    return MRSPEEDUP_OK;
+}
 
-    if (motionOnly) return 0;
+/* choose the frames to drop */
+int mrspeedupSelect(struct MrSpeedup *job)
+{
+    struct MrSpeedupOptions *opts = &job->options;
+    struct FrameTable frameTable;
+    unsigned long long frameCount = job->frameCount, dropFrames = opts->dropFrames;
+    int windowSize = opts->windowSize;
+
+    if (!job->analyzed || job->frameSelections) return MRSPEEDUP_EORDER;
+    if (opts->speedup < 0 ||
+        !!opts->speedup + !!opts->dropFrames + !!opts->keepFrames != 1) {
+        fprintf(stderr, "Exactly one of a speedup, a number of frames to drop or a number\n"
+                        "of frames to keep is needed to select frames.\n");
+        return MRSPEEDUP_EINVAL;
+    }
 
     /* now calculate the number of frames we need to drop */
-    frameCount = frameDiffs.bufused;
-    if (speedup) {
-        dropFrames = frameCount * (speedup - 1) / speedup;
-    } else if (keepFrames) {
-        dropFrames = frameCount - keepFrames;
+    if (opts->speedup) {
+        dropFrames = frameCount * (opts->speedup - 1) / opts->speedup;
+    } else if (opts->keepFrames) {
+        dropFrames = frameCount - opts->keepFrames;
     }
 
     /* adjust the frame diff data for the window size */
-    if (windowSize == 0) windowSize = fps / 3;
+    if (windowSize == 0) windowSize = opts->fps / 3;
     if (windowSize > 1) {
-        calcWindow(&frameDiffs, windowSize);
+        statsStart(statsStage(job->stats, STATS_WINDOW));
+        calcWindow(&job->frameDiffs, windowSize, opts->windowKernel);
+        statsStop(statsStage(job->stats, STATS_WINDOW));
+        STATS_ADD(statsStage(job->stats, STATS_WINDOW), frames, frameCount);
     }
 
-    /* get it into the map */
-    mkFrameDiffMap(&frameDiffMap, &frameDiffs);
+    /* get it into the table */
+    statsStart(statsStage(job->stats, STATS_SORT));
+    mkFrameTable(&frameTable, &job->frameDiffs);
 
     /* sort it */
-    qsort(frameDiffMap, frameCount, sizeof(struct FrameDiff *), frameDiffCompare);
+    sortFrameTable(&frameTable);
+    statsStop(statsStage(job->stats, STATS_SORT));
+    STATS_ADD(statsStage(job->stats, STATS_SORT), frames, frameCount);
 
     /* base our selections at keeping everything */
-    SF(frameSelections, calloc, NULL, (frameDiffs.bufused, 1));
+    SF(job->frameSelections, calloc, NULL, (frameCount ? frameCount : 1, 1));
 
     /* now drop the appropriate number of frames */
-    dropFramesf(frameSelections, frameCount, frameDiffMap, dropFrames, clipshowDivisor);
+    statsStart(statsStage(job->stats, STATS_DROP));
+    dropFramesf(job->frameSelections, &frameTable, dropFrames, opts->clipshowDivisor);
+    statsStop(statsStage(job->stats, STATS_DROP));
+    STATS_ADD(statsStage(job->stats, STATS_DROP), frames, frameCount);
+    freeFrameTable(&frameTable);
+
+    return MRSPEEDUP_OK;
+}
 
-    /* make the audio file */
-    if (audioFile) mkAudioFile(audioFile, inputFile, frameSelections, frameCount, fps);
+/* write out the new video and the audio file at once, then mux them */
+int mrspeedupRender(struct MrSpeedup *job)
+{
+    struct MrSpeedupOptions *opts = &job->options;
+    pid_t stagePids[2];
+    int stageDone[2];
+    const char *stageNames[2];
+    int stages = 0, failed;
+
+    if (!job->frameSelections) return MRSPEEDUP_EORDER;
+    if (!opts->outputFile) {
+        fprintf(stderr, "Rendering needs an output file.\n");
+        return MRSPEEDUP_EINVAL;
+    }
 
-    /* and write out the new video */
-    selectFrames(outputFile, inputFile, frameSelections, frameCount, width, height, fps);
+    stagePids[stages] = startStage(job, renderVideo, &stageDone[stages]);
+    job->stageGroups[stages] = stagePids[stages];
+    stageNames[stages++] = "video";
 
-    return 0;
+    if (opts->audioFile) {
+        stagePids[stages] = startStage(job, renderAudio, &stageDone[stages]);
+        job->stageGroups[stages] = stagePids[stages];
+        stageNames[stages++] = "audio";
+    }
+
+    failed = superviseStages(job, stagePids, stageDone, stageNames, stages);
+
+    /* the spool was only for this */
+    if (job->spoolp) {
+        closeFrameSpool(job->spoolp);
+        job->spoolp = NULL;
+    }
+
+    /* then put them together */
+    if (!failed && opts->muxFile) {
+        statsStart(statsStage(job->stats, STATS_MUX));
+        failed = muxOutput(job);
+        statsStop(statsStage(job->stats, STATS_MUX));
+    }
+
+    return failed ? MRSPEEDUP_EOUTPUT : MRSPEEDUP_OK;
 }
 
-void usage()
-{
-    fprintf(stderr,
-        "Usage: mrspeedup -w <video width> -h <video height>\n"
-        "       {-s <speedup>|--drop-frames <#>|--keep-frames <#>} [options]\n"
-        "       <input video> <output video>\n"
-        "Flags:\n"
-        "\t-w|--width <video width>\n"
-        "\t\t(Required) Specify video width.\n"
-        "\t-h|--height <video height>\n"
-        "\t\t(Required) Specify video height.\n"
-        "\t-s|--speedup <speedup>\n"
-        "\t\tAverage speedup, used to calculate number of frames to drop.\n"
-        "\t--drop-frames <#>\n"
-        "\t\tAs an alternative to average speedup, precise number of frames to\n"
-        "\t\tdrop.\n"
-        "\t--keep-frames <#>\n"
-        "\t\tSimilar to --drop-frames, but number of frames to keep.\n"
-        "\t-m|--motion-data <file>\n"
-        "\t\tWrite/read motion data to/from the specified file.\n"
-        "\t-M|--motion-only\n"
-        "\t\tOnly calculate motion data, do not perform speedup. Motion data\n"
-        "\t\twill be written to the motion data file if specified, or the\n"
-        "\t\toutput file which would be used for the video otherwise.\n"
-        "\t--fps <#>\n"
-        "\t\tSpecify video FPS. Default 30.\n"
-        "\t--ffmpeg <cmd>\n"
-        "\t\tSpecify ffmpeg binary. Default \"ffmpeg\".\n"
-        "\t--window <#>\n"
-        "\t\tNumber of frames in the motion window. Default is 1 (i.e., no\n"
-        "\t\twindow). '0' will select 1/3rd of a second.\n"
-        "\t--clipshow-divisor <#>\n"
-        "\t\tSpecify the \"clipshow divisor\". Larger values put more emphasis\n"
-        "\t\ton keeping frames which are active in the original than on keeping\n"
-        "\t\tan equal amount of action per frame; i.e., it creates a sort of\n"
-        "\t\t\"clip show\". Values less than 1 are valid. 0 is interpreted as\n"
-        "\t\tinfinity, which will give priority ONLY to keeping active frames\n"
-        "\t\tin the original. Default 1.\n");
-}
-
-/* calculate the motion data for this input file */
-void calcMotionData(struct Buffer_double *frameDiffs, const char *inputFile,
-                    int width, int height)
+/* the motion data */
+const double *mrspeedupFrameDiffs(struct MrSpeedup *job, unsigned long long *frameCount)
+{
+    *frameCount = job->analyzed ? job->frameCount : 0;
+    return job->analyzed ? job->frameDiffs.buf : NULL;
+}
+
+/* the frame selections */
+const unsigned char *mrspeedupFrameSelections(struct MrSpeedup *job,
+                                              unsigned long long *frameCount)
+{
+    *frameCount = job->frameSelections ? job->frameCount : 0;
+    return job->frameSelections;
+}
+
+/* write the statistics report */
+int mrspeedupWriteStats(struct MrSpeedup *job, FILE *out, int failed)
+{
+    struct MrSpeedupOptions *opts = &job->options;
+    unsigned long long keptFrames = 0, i;
+
+    if (job->frameSelections) {
+        for (i = 0; i < job->frameCount; i++)
+            if (!job->frameSelections[i]) keptFrames++;
+    }
+
+    return writeStats(job->stats, out, opts->inputFile,
+                      opts->muxFile ? opts->muxFile : opts->outputFile,
+                      job->analyzed ? job->frameCount : 0, keptFrames, failed);
+}
+
+/* pass a signal on to the output stages */
+void mrspeedupInterrupt(struct MrSpeedup *job, int sig)
 {
-    int tmpi;
-    pid_t pid;
-    FILE *rawData;
-    int frameSize;
-    unsigned char *lastFrame, *curFrame;
-    double logs[256];
-    char *tmps;
-    char fifo[] = "/tmp/mrspeedup.XXXXXX\0fifo";
-    int fifoDirLen = strlen(fifo);
     int i;
+    for (i = 0; i < 2; i++)
+        if (job->stageGroups[i] > 0) kill(-job->stageGroups[i], sig);
+}
 
-    frameSize = width * height;
+/* free a job */
+void mrspeedupFree(struct MrSpeedup *job)
+{
+    if (!job) return;
 
-    /* precalculate all our logarithms */
-    for (i = 0; i < 256; i++)
-        logs[i] = log(i + 1);
+    if (job->analyzed) {
+        if (job->motionMapped)
+            closeMotionFile(&job->motion);
+        else
+            FREE_BUFFER(job->frameDiffs);
+    }
+    if (job->spoolp) closeFrameSpool(job->spoolp);
+    if (job->stats) freeStats(job->stats);
+    free(job->frameSelections);
+    free(job->cacheDir);
+    free(job->cacheEntry);
+    free(job);
+}
 
-    /* make a temporary directory for our fifo */
-    SF(tmps, mkdtemp, NULL, (fifo));
-    fifo[fifoDirLen] = '/';
+/* describe an error code */
+const char *mrspeedupStrerror(int err)
+{
+    switch (err) {
+        case MRSPEEDUP_OK: return "Success";
+        case MRSPEEDUP_EINVAL: return "Invalid options";
+        case MRSPEEDUP_EORDER: return "Stage run out of order";
+        case MRSPEEDUP_EMOTION: return "Unusable motion data file";
+        case MRSPEEDUP_EINPUT: return "The input could not be decoded";
+        case MRSPEEDUP_EOUTPUT: return "Making the output failed";
+        default: return "Unknown error";
+    }
+}
 
-    /* and make the fifo */
-    SF(tmpi, mkfifo, -1, (fifo, 0600));
+/* calculate the motion data for this input file. Returns -1 if a decoder
+ * failed. */
+static int calcMotionData(struct MrSpeedup *job, struct MotionWriter *writer)
+{
+    struct MrSpeedupOptions *opts = &job->options;
+    struct Buffer_double *frameDiffs = &job->frameDiffs;
+    struct FrameSpool *spool = job->spoolp;
+    const char *inputFile = opts->inputFile;
+    int width = opts->width, height = opts->height;
+    int motionWidth = opts->motionWidth, motionHeight = opts->motionHeight;
+    int threads = opts->threads, segments = opts->segments;
+    double sampleBound = opts->sampleBound;
+    char scale[64];
+    struct MotionSegment *segs;
+    pthread_t *segThreads;
+    struct FrameRate rate;
+    unsigned long long totalFrames = 0;
+    unsigned long long resumeFrom = frameDiffs->bufused;
+    unsigned long long estimated = 0, refined = 0;
+    double errorSum = 0, errorMax = 0;
+    int i, tmpi, failed = 0, misaligned;
+
+    /* choose our difference kernel, once for every job */
+    pthread_once(&initOnce, initFrameDifference);
+
+    /* have ffmpeg shrink the frames if we're analyzing at lower resolution */
+    snprintf(scale, sizeof(scale), "scale=%d:%d:flags=area", motionWidth, motionHeight);
+
+    /* a resumed analysis is one segment, picking up from the checkpoint */
+    if (resumeFrom) {
+        fprintf(stderr, "Resuming motion analysis at frame %llu\n", resumeFrom);
+        segments = 1;
+    }
 
-    /* now run ffmpeg */
-    SF(pid, fork, -1, ());
-    if (pid == 0) {
-        SF(tmpi, execlp, -1, (ffmpegCommand, ffmpegCommand,
-            "-i", inputFile,
-            "-f", "rawvideo", "-pix_fmt", "gray",
-            "-y", fifo, NULL));
+    /* we need to know the length to split it into segments, and the exact
+     * frame rate to seek to each */
+    if (segments > 1) {
+        if (probeInput(job) == 0) totalFrames = job->probedFrames;
+        if (totalFrames < segments) {
+            fprintf(stderr, "Could not determine the length of %s, not splitting it into segments.\n",
+                    inputFile);
+            segments = 1;
+        }
+    }
+    if (segments < 1) segments = 1;
+    rate = job->rate;
+    if (!rate.num) {
+        rate.num = opts->fps;
+        rate.den = 1;
     }
 
-    /* and calculate the motion data */
-    SF(lastFrame, calloc, NULL, (frameSize, 1));
-    SF(curFrame, malloc, NULL, (frameSize));
-    SF(rawData, fopen, NULL, (fifo, "rb"));
+    while (1) {
+        SF(segs, calloc, NULL, (segments, sizeof(struct MotionSegment)));
+        for (i = 0; i < segments; i++) {
+            struct MotionSegment *seg = &segs[i];
+            seg->ffmpegCommand = opts->ffmpegCommand;
+            seg->inputFile = inputFile;
+            seg->scale = (motionWidth != width || motionHeight != height) ? scale : NULL;
+            seg->width = motionWidth;
+            seg->frameSize = seg->frameStride = motionWidth * motionHeight;
+            seg->sampleBound = sampleBound;
+            seg->rate = rate;
+            seg->metric.metric = opts->metric;
+            seg->metric.threshold = opts->metricThreshold;
+            seg->stats = statsStage(job->stats, STATS_ANALYZE);
+            seg->threads = threads / segments;
+            if (seg->threads < 1) seg->threads = 1;
+            seg->start = totalFrames * i / segments;
+            if (segments == 1) {
+                seg->frameDiffs = frameDiffs;
+                seg->writer = writer;
+                if (spool) {
+                    /* decode to yuv420p, and diff the luma plane */
+                    seg->spool = spool;
+                    seg->frameStride = spool->frameSize;
+                }
+                if (resumeFrom) {
+                    /* decode the frame before the checkpoint to diff against */
+                    seg->start = resumeFrom - 1;
+                    seg->skip = 1;
+                    seg->resumeFrame = writer->header.checkpointFrame;
+                }
+            } else {
+                /* each segment but the last also decodes the first frame of
+                 * the next, to check that they line up */
+                if (i < segments - 1)
+                    seg->count = totalFrames * (i + 1) / segments - seg->start + 1;
+                SF(seg->frameDiffs, malloc, NULL, (sizeof(struct Buffer_double)));
+                INIT_BUFFER(*seg->frameDiffs);
+                SF(seg->firstFrame, malloc, NULL, (seg->frameSize));
+                SF(seg->lastFrame, malloc, NULL, (seg->frameSize));
+            }
+        }
 
-    while (!feof(rawData) && !ferror(rawData)) {
-        if (fread(curFrame, 1, frameSize, rawData) == frameSize) {
-            double diff = 0;
-            /* calculate the difference for this frame */
-            for (i = 0; i < frameSize; i++)
-                diff += fabs(logs[curFrame[i]] - logs[lastFrame[i]]);
-            WRITE_ONE_BUFFER(*frameDiffs, diff);
-            memcpy(lastFrame, curFrame, frameSize);
+        if (segments == 1) {
+            decodeMotionSegment(segs);
+            if (!segs->misaligned) break;
+
+            /* ffmpeg's seeking didn't land on the checkpointed frame, so
+             * nothing after it can be trusted */
+            fprintf(stderr, "Could not seek %s to frame %llu to resume, analyzing it from the start.\n",
+                    inputFile, resumeFrom - 1);
+            free(segs);
+            resumeFrom = 0;
+            frameDiffs->bufused = 0;
+            rewindMotionWriter(writer);
+            continue;
         }
+
+        /* decode all the segments at once */
+        SF(segThreads, malloc, NULL, (segments * sizeof(pthread_t)));
+        for (i = 0; i < segments; i++) {
+            if ((tmpi = pthread_create(&segThreads[i], NULL, motionSegmentThread, &segs[i]))) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(tmpi));
+                exit(1);
+            }
+        }
+        for (i = 0; i < segments; i++)
+            pthread_join(segThreads[i], NULL);
+        free(segThreads);
+
+        /* each segment must have ended with the frame the next one started
+         * with. If ffmpeg's seeking didn't land on the right frames, or the
+         * input is shorter than ffprobe said, start over in one piece. */
+        misaligned = 0;
+        for (i = 0; i < segments; i++) {
+            struct MotionSegment *seg = &segs[i];
+            if (seg->failed) break;
+            if (!seg->frameDiffs->bufused ||
+                (i < segments - 1 &&
+                 (seg->frameDiffs->bufused != seg->count ||
+                  !segs[i + 1].frameDiffs->bufused ||
+                  memcmp(seg->lastFrame, segs[i + 1].firstFrame, seg->frameSize))))
+                misaligned = 1;
+        }
+
+        /* the diff of each segment's extra frame is the one the next segment
+         * should start with, its first having been taken against a blank frame */
+        if (i == segments && !misaligned) {
+            for (i = 0; i < segments; i++) {
+                struct Buffer_double *segDiffs = segs[i].frameDiffs;
+                if (i == 0) {
+                    WRITE_BUFFER(*frameDiffs, segDiffs->buf, segDiffs->bufused);
+                } else {
+                    WRITE_BUFFER(*frameDiffs, segDiffs->buf + 1, segDiffs->bufused - 1);
+                }
+            }
+        }
+
+        for (i = 0; i < segments; i++) {
+            FREE_BUFFER(*segs[i].frameDiffs);
+            free(segs[i].frameDiffs);
+            free(segs[i].firstFrame);
+            free(segs[i].lastFrame);
+        }
+
+        if (!misaligned) break;
+        fprintf(stderr, "The segments of %s did not line up, analyzing it in one piece.\n",
+                inputFile);
+        free(segs);
+        segments = 1;
+        totalFrames = 0;
     }
 
-    fclose(rawData);
-    free(curFrame);
+    /* say how good our estimates were */
+    if (sampleBound > 0) {
+        for (i = 0; i < segments; i++) {
+            estimated += segs[i].estimated;
+            refined += segs[i].refined;
+            errorSum += segs[i].errorSum;
+            if (segs[i].errorMax > errorMax) errorMax = segs[i].errorMax;
+        }
+        fprintf(stderr, "Adaptive sampling: %llu of %llu frames calculated exactly; estimated\n"
+                        "error of the rest %.2f%% on average, %.2f%% at most\n",
+                refined, estimated + refined,
+                estimated ? errorSum / estimated * 100 : 0.0, errorMax * 100);
+    }
+
+    for (i = 0; i < segments; i++)
+        if (segs[i].failed) failed = -1;
+    free(segs);
+    return failed;
+}
 
+/* find the input's frame rate and length with ffprobe, once. Returns -1 if
+ * the frame rate couldn't be found. */
+static int probeInput(struct MrSpeedup *job)
+{
+    if (!job->probed) {
+        job->probed = 1;
+        probeVideo(job->options.ffprobeCommand, job->options.inputFile,
+                   &job->rate, &job->probedFrames);
+    }
+    return job->rate.num ? 0 : -1;
+}
+
+/* get the frame rate and length in frames of this input's video from
+ * ffprobe. The length is estimated from the duration if the container doesn't
+ * give it. Either is left 0 if it can't be found. */
+static void probeVideo(const char *ffprobeCommand, const char *inputFile,
+                       struct FrameRate *rate, unsigned long long *frames)
+{
+    int tmpi;
+    pid_t pid;
+    int pipefd[2];
+    FILE *probe;
+    char line[256];
+    unsigned num, den;
+    unsigned long long nbFrames = 0;
+    double duration = -1;
+
+    rate->num = rate->den = 0;
+    *frames = 0;
+
+    /* the pipe mustn't leak into processes another job forks meanwhile */
+    SF(tmpi, pipe2, -1, (pipefd, O_CLOEXEC));
+    SF(pid, fork, -1, ());
+    if (pid == 0) {
+        dup2(pipefd[1], 1);
+        SF(tmpi, execlp, -1, (ffprobeCommand, ffprobeCommand,
+            "-v", "error",
+            "-select_streams", "v:0",
+            "-show_entries", "stream=r_frame_rate,nb_frames:format=duration",
+            "-of", "default=noprint_wrappers=1",
+            inputFile, NULL));
+    }
+    close(pipefd[1]);
+
+    /* nb_frames and duration may be N/A */
+    SF(probe, fdopen, NULL, (pipefd[0], "r"));
+    while (fgets(line, sizeof(line), probe)) {
+        if (sscanf(line, "r_frame_rate=%u/%u", &num, &den) == 2 && num && den) {
+            rate->num = num;
+            rate->den = den;
+        } else if (sscanf(line, "nb_frames=%llu", &nbFrames) != 1 &&
+                   sscanf(line, "duration=%lf", &duration) != 1) {
+            continue;
+        }
+    }
+    fclose(probe);
     waitpid(pid, NULL, 0);
 
-    unlink(fifo);
-    fifo[fifoDirLen] = '\0';
-    rmdir(fifo);
+    if (nbFrames)
+        *frames = nbFrames;
+    else if (rate->num && duration > 0)
+        *frames = duration * rate->num / rate->den;
+}
+
+/* the time to seek to for this frame at this rate. It's half a frame early, so
+ * that rounding can't lose the frame. */
+static void seekTime(char *buf, size_t size, unsigned long long frame,
+                     const struct FrameRate *rate)
+{
+    snprintf(buf, size, "%.6f", (frame - 0.5) * rate->den / rate->num);
 }
 
-/* write the motion data out to a file */
-void writeMotionData(const char *motionFile, struct Buffer_double *frameDiffs)
+/* decode this segment to gray and calculate its motion data. Returns -1 (and
+ * sets failed) if the decoder failed. */
+static int decodeMotionSegment(struct MotionSegment *segment)
 {
-    FILE *fd;
+    int tmpi;
+    pid_t pid;
+    int pipefd[2];
+    FILE *rawData;
+    char sss[64], framess[32];
+    struct Buffer_charp args;
 
-    SF(fd, fopen, NULL, (motionFile, "wd"));
-    if (fwrite(frameDiffs->buf, sizeof(double), frameDiffs->bufused, fd) != frameDiffs->bufused) {
-        perror(motionFile);
-        exit(1);
+    /* the ffmpeg command, seeking to the segment's first frame */
+    INIT_BUFFER(args);
+    WRITE_ONE_BUFFER(args, (char *) segment->ffmpegCommand);
+    if (segment->start) {
+        seekTime(sss, sizeof(sss), segment->start, &segment->rate);
+        WRITE_ONE_BUFFER(args, "-ss");
+        WRITE_ONE_BUFFER(args, sss);
+    }
+    WRITE_ONE_BUFFER(args, "-i");
+    WRITE_ONE_BUFFER(args, (char *) segment->inputFile);
+    if (segment->count) {
+        snprintf(framess, sizeof(framess), "%llu", segment->count);
+        WRITE_ONE_BUFFER(args, "-frames:v");
+        WRITE_ONE_BUFFER(args, framess);
+    }
+    if (segment->scale) {
+        WRITE_ONE_BUFFER(args, "-vf");
+        WRITE_ONE_BUFFER(args, (char *) segment->scale);
     }
-    fclose(fd);
+    WRITE_ONE_BUFFER(args, "-f");
+    WRITE_ONE_BUFFER(args, "rawvideo");
+    WRITE_ONE_BUFFER(args, "-pix_fmt");
+    WRITE_ONE_BUFFER(args, segment->spool ? "yuv420p" : "gray");
+    WRITE_ONE_BUFFER(args, "-y");
+    WRITE_ONE_BUFFER(args, "pipe:1");
+    WRITE_ONE_BUFFER(args, NULL);
+
+    /* now run ffmpeg. Our end of the pipe mustn't leak into the other
+     * segments' ffmpegs, or they'd keep it open. */
+    SF(tmpi, pipe2, -1, (pipefd, O_CLOEXEC));
+    growPipe(pipefd[0]);
+    SF(pid, fork, -1, ());
+    if (pid == 0) {
+        dup2(open("/dev/null", O_RDONLY), 0);
+        dup2(pipefd[1], 1);
+        SF(tmpi, execvp, -1, (args.buf[0], args.buf));
+    }
+    close(pipefd[1]);
+    FREE_BUFFER(args);
+
+    /* and calculate the motion data. If ffmpeg dies, this just sees the end
+     * of the stream. */
+    SF(rawData, fdopen, NULL, (pipefd[0], "rb"));
+    diffFrameStream(segment, rawData);
+    fclose(rawData);
+
+    /* if we stopped reading, ffmpeg was cut off, which isn't its fault */
+    if (segment->misaligned)
+        reapChild(pid, segment->stats);
+    else if (waitChild(pid, "decoding the input", segment->stats) < 0)
+        segment->failed = 1;
+    return segment->failed ? -1 : 0;
 }
 
-/* compare these frame diffs */
-int frameDiffCmp(const struct FrameDiff *l, const struct FrameDiff *r)
+/* thread to decode a motion segment */
+static void *motionSegmentThread(void *segmentvp)
 {
-    if (l->frameDiff == r->frameDiff) {
-        if (l->frameNo > r->frameNo) return 1;
-        else if (l->frameNo < r->frameNo) return -1;
-        else return 0;
-    } else {
-        if (l->frameDiff > r->frameDiff) return 1;
-        else if (l->frameDiff < r->frameDiff) return -1;
-        else return 0;
-    }
+    struct MotionSegment *segment = (struct MotionSegment *) segmentvp;
+    decodeMotionSegment(segment);
+    statsThreadDone(segment->stats);
+    return NULL;
 }
 
-/* compare these frame diffs (for qsort) */
-int frameDiffCompare(const void *lvp, const void *rvp)
+/* calculate the differences between consecutive frames of a raw stream. This
+ * thread reads frames into a ring of slots, and the workers diff each frame
+ * against its predecessor. A slot is reused once both diffs using it are done,
+ * and its diff is written out then, so the segment's diffs stay in frame order.
+ * The first and last frames are copied out if requested. */
+static void diffFrameStream(struct MotionSegment *segment, FILE *rawData)
 {
-    const struct FrameDiff *l = *((const struct FrameDiff **) lvp);
-    const struct FrameDiff *r = *((const struct FrameDiff **) rvp);
+    size_t frameSize = segment->frameSize, frameStride = segment->frameStride;
+    int threads = segment->threads;
+    struct MotionPool pool;
+    pthread_t *workers;
+    unsigned long long frame, written, since;
+    size_t rd;
+    int i, tmpi;
+    struct StageStats *stats = segment->stats;
+
+    /* two slots per worker keeps them busy while the oldest frame finishes */
+    pool.slotCount = threads * 2 + 2;
+    pool.frameSize = frameSize;
+    pool.framesRead = pool.nextFrame = 0;
+    pool.eof = 0;
+    pool.segment = segment;
+    pool.scale = 0;
+    pool.scales = NULL;
+    if (segment->sampleBound > 0) {
+        SF(pool.scales, malloc, NULL, (sizeof(struct Buffer_double)));
+        INIT_BUFFER(*pool.scales);
+    }
+    SF(pool.blankFrame, calloc, NULL, (frameSize, 1));
+    SF(pool.slots, calloc, NULL, (pool.slotCount, sizeof(struct MotionSlot)));
+    for (i = 0; i < pool.slotCount; i++) {
+        SF(pool.slots[i].frame, malloc, NULL, (frameStride));
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.frameRead, NULL);
+    pthread_cond_init(&pool.slotDone, NULL);
+
+    SF(workers, malloc, NULL, (threads * sizeof(pthread_t)));
+    for (i = 0; i < threads; i++) {
+        if ((tmpi = pthread_create(&workers[i], NULL, motionWorker, &pool))) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(tmpi));
+            exit(1);
+        }
+    }
+
+    written = 0;
+    for (frame = 0; !feof(rawData) && !ferror(rawData); frame++) {
+        struct MotionSlot *slot = &pool.slots[frame % pool.slotCount];
+
+        if (frame >= pool.slotCount) {
+            /* wait for the frame in this slot to be finished with */
+            pthread_mutex_lock(&pool.lock);
+            while (slot->uses)
+                pthread_cond_wait(&pool.slotDone, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+            segmentDiff(segment, written, slot->diff, slot->frame);
+            written++;
+        }
+
+        since = statsNow();
+        rd = fread(slot->frame, 1, frameStride, rawData);
+        STATS_SINCE(stats, readBlocked, since);
+        if (rd != frameStride) break;
+        STATS_ADD(stats, bytesIn, frameStride);
+        if (segment->spool) spoolFrame(segment->spool, slot->frame);
+        if (frame == 0 && segment->firstFrame)
+            memcpy(segment->firstFrame, slot->frame, frameSize);
+
+        /* a resumed analysis must have sought to the checkpointed frame */
+        if (frame == 0 && segment->resumeFrame &&
+            motionFrameHash(slot->frame, frameSize) != segment->resumeFrame) {
+            segment->misaligned = 1;
+            break;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        slot->uses = 2;
+        slot->done = 0;
+        pool.framesRead = frame + 1;
+        pthread_cond_signal(&pool.frameRead);
+        pthread_mutex_unlock(&pool.lock);
+    }
 
-    return frameDiffCmp(l, r);
+    pthread_mutex_lock(&pool.lock);
+    pool.eof = 1;
+    pthread_cond_broadcast(&pool.frameRead);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+
+    /* write out whatever's left in the ring */
+    for (; written < pool.framesRead; written++)
+        segmentDiff(segment, written, pool.slots[written % pool.slotCount].diff,
+                    pool.slots[written % pool.slotCount].frame);
+    if (pool.framesRead && segment->lastFrame)
+        memcpy(segment->lastFrame, pool.slots[(pool.framesRead - 1) % pool.slotCount].frame,
+               frameSize);
+
+    pthread_cond_destroy(&pool.slotDone);
+    pthread_cond_destroy(&pool.frameRead);
+    pthread_mutex_destroy(&pool.lock);
+    for (i = 0; i < pool.slotCount; i++)
+        free(pool.slots[i].frame);
+    free(pool.slots);
+    free(pool.blankFrame);
+    if (pool.scales) {
+        FREE_BUFFER(*pool.scales);
+        free(pool.scales);
+    }
+    free(workers);
 }
 
-/* binary search in an array of frame diffs */
-int frameDiffBSearch(struct FrameDiff *key, struct FrameDiff **arr, size_t ct)
+/* output the diff for this frame of a segment, checkpointing if it's time.
+ * The frame itself is hashed into the checkpoint, to resume from. */
+static void segmentDiff(struct MotionSegment *segment, unsigned long long frame, double diff,
+                        const unsigned char *frameData)
 {
-    struct FrameDiff **base = arr;
-    size_t half;
-    int cmp;
+    struct Buffer_double *frameDiffs = segment->frameDiffs;
+    struct MotionWriter *writer = segment->writer;
 
-retry:
-    half = ct / 2;
-    /* choose either the left half or the right half */
-    cmp = frameDiffCmp(arr[half], key);
-    if (cmp < 0) {
-        if (ct == 1) {
-            /* at the end! */
-            return arr + 1 - base;
-        }
+    if (frame < segment->skip) return;
+    WRITE_ONE_BUFFER(*frameDiffs, diff);
 
-        /* try the latter half */
-        arr += half;
-        ct -= half;
+    /* a failed checkpoint is reported when the writer is finished */
+    if (writer && writer->interval && !writer->error &&
+        frameDiffs->bufused - writer->header.frameCount >= writer->interval)
+        checkpointMotionWriter(writer, frameDiffs->buf, frameDiffs->bufused,
+                               motionFrameHash(frameData, segment->frameSize));
+}
 
-    } else if (cmp > 0) {
-        if ((half == 0 && base == arr) ||
-            frameDiffCmp(arr[half-1], key) < 0) {
-            /* found our insertion point */
-            return arr + half - base;
+/* a motion analysis worker, diffing frames as they're read */
+static void *motionWorker(void *poolvp)
+{
+    struct MotionPool *pool = (struct MotionPool *) poolvp;
+    unsigned long long frame;
+    struct MotionSlot *slot, *lastSlot;
+    unsigned char *lastFrame;
+    double diff, scale = 0, error = 0;
+    int refined = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->nextFrame >= pool->framesRead && !pool->eof)
+            pthread_cond_wait(&pool->frameRead, &pool->lock);
+        if (pool->nextFrame >= pool->framesRead) break;
+
+        /* claim this frame */
+        frame = pool->nextFrame++;
+        slot = &pool->slots[frame % pool->slotCount];
+        if (frame == 0) {
+            lastSlot = NULL;
+            lastFrame = pool->blankFrame;
+        } else {
+            lastSlot = &pool->slots[(frame - 1) % pool->slotCount];
+            lastFrame = lastSlot->frame;
         }
 
-        /* try the first half */
-        ct -= half;
+        /* sampling needs the running scale from a fixed distance back */
+        if (pool->scales && frame >= ADAPTIVE_LAG) {
+            while (pool->scales->bufused <= frame - ADAPTIVE_LAG)
+                pthread_cond_wait(&pool->slotDone, &pool->lock);
+            scale = pool->scales->buf[frame - ADAPTIVE_LAG];
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (pool->scales)
+            diff = adaptiveDifference(pool->segment, slot->frame, lastFrame, scale,
+                                      &refined, &error);
+        else
+            diff = frameDifference(&pool->segment->metric, slot->frame, lastFrame,
+                                   pool->frameSize);
+
+        pthread_mutex_lock(&pool->lock);
+        slot->diff = diff;
+        slot->done = 1;
+        slot->uses--;
+        if (lastSlot) lastSlot->uses--;
+        if (pool->scales) {
+            if (refined) {
+                pool->segment->refined++;
+            } else {
+                pool->segment->estimated++;
+                pool->segment->errorSum += error;
+                if (error > pool->segment->errorMax) pool->segment->errorMax = error;
+            }
+            motionScaleUpdate(pool);
+        }
+        pthread_cond_broadcast(&pool->slotDone);
+    }
+    pthread_mutex_unlock(&pool->lock);
 
-    } else {
-        /* found our insertion point */
-        return arr + half - base;
+    statsThreadDone(pool->segment->stats);
+    return NULL;
+}
 
+/* estimate the difference between these frames from a sample of their pixels,
+ * calculating it exactly if the estimate isn't good enough */
+static double adaptiveDifference(struct MotionSegment *segment, const unsigned char *cur,
+                                 const unsigned char *last, double scale,
+                                 int *refined, double *error)
+{
+    size_t width = segment->width, frameSize = segment->frameSize;
+    unsigned long long sum, ct;
+    double sumSquares, mean, var, estimate, stdError, tolerance;
+
+    sum = frameDifferenceSampledQ(&segment->metric, cur, last, width, frameSize / width,
+                                  ADAPTIVE_STRIDE, &ct, &sumSquares);
+
+    if (ct >= ADAPTIVE_MIN_SAMPLES) {
+        /* scale the sample mean up to the frame, with the standard error of
+         * sampling ct of frameSize pixels without replacement */
+        mean = (double) sum / ct;
+        var = (sumSquares - sum * mean) / (ct - 1);
+        if (var < 0) var = 0;
+        estimate = mean * frameSize * frameDifferenceUnit(&segment->metric);
+        stdError = frameSize * sqrt(var / ct * (1 - (double) ct / frameSize)) *
+            frameDifferenceUnit(&segment->metric);
+
+        /* with nothing to compare to, a sample that saw no motion proves
+         * nothing */
+        tolerance = segment->sampleBound * ((estimate > scale) ? estimate : scale);
+        if (tolerance > 0 && ADAPTIVE_Z * stdError <= tolerance) {
+            *refined = 0;
+            *error = ADAPTIVE_Z * stdError / tolerance * segment->sampleBound;
+            return estimate;
+        }
     }
-    goto retry;
+
+    *refined = 1;
+    *error = 0;
+    return frameDifference(&segment->metric, cur, last, frameSize);
 }
 
-/* calculate frame windows */
-void calcWindow(struct Buffer_double *frameDiffs, int windowSize)
+/* fold newly finished diffs, in order, into the running scale of motion. The
+ * diff against the blank frame before the first isn't motion, so it's left
+ * out. */
+static void motionScaleUpdate(struct MotionPool *pool)
 {
-    long long i, j;
-    for (i = frameDiffs->bufused; i >= 0; i--) {
-        double val = 0;
-        for (j = i; j > i - windowSize && j >= 0; j--)
-            val += frameDiffs->buf[j];
-        frameDiffs->buf[i] = val;
+    struct Buffer_double *scales = pool->scales;
+    unsigned long long frame;
+    struct MotionSlot *slot;
+
+    while ((frame = scales->bufused) < pool->framesRead) {
+        slot = &pool->slots[frame % pool->slotCount];
+        if (!slot->done) break;
+        if (frame == 1)
+            pool->scale = slot->diff;
+        else if (frame > 1)
+            pool->scale += (slot->diff - pool->scale) / ADAPTIVE_SCALE_FRAMES;
+        WRITE_ONE_BUFFER(*scales, pool->scale);
     }
 }
 
-/* turn frame differences into a sortable map of frame differences */
-void mkFrameDiffMap(struct FrameDiff ***frameDiffMapPtr, struct Buffer_double *frameDiffs)
+/* make a video of the selected frames. With more than one encoder, the kept
+ * frames are split into that many runs of about the same length, each made
+ * into a chunk by its own process, and the chunks are then joined. Unless the
+ * frames are spooled, each chunk seeks the input by its probed frame rate; if
+ * the chunks don't line up, the video is made again in one piece. */
+static int selectFrames(struct MrSpeedup *job)
 {
-    struct FrameDiff **frameDiffMap;
-    struct FrameDiff *frameDiff;
-    unsigned long long i;
+    const char *outputFile = job->options.outputFile;
+    const char *ffmpegCommand = job->options.ffmpegCommand;
+    unsigned char *frameSelections = job->frameSelections;
+    unsigned long long frameCount = job->frameCount;
+    struct FrameSpool *spool = job->spoolp;
+    struct StageStats *stats = statsStage(job->stats, STATS_VIDEO);
+    int encoders = job->options.encoders;
+    char dir[] = "/tmp/mrspeedup.XXXXXX";
+    char *tmps, *list;
+    char **chunkFiles;
+    unsigned long long *chunkStarts;
+    unsigned long long kept = 0, keptSoFar, i;
+    size_t frameSize = job->options.width * job->options.height * 6 / 4;
+    struct ChunkCheck *checks = NULL;
+    unsigned char *checkFrames;
+    size_t checksSize = 0;
+    int chunk, failed, misaligned, tmpi;
+    pid_t pid, *pids;
+    FILE *listf;
+
+    /* the frames may already be spooled, so we needn't decode them again */
+    if (spool && spool->frames != frameCount) spool = NULL;
+
+    for (i = 0; i < frameCount; i++)
+        if (!frameSelections[i]) kept++;
+    if (encoders > kept) encoders = kept;
+
+    if (encoders > 1 && !spool && probeInput(job) < 0) {
+        fprintf(stderr, "Could not determine the frame rate of %s, encoding it in one piece.\n",
+                job->options.inputFile);
+        encoders = 1;
+    }
 
-    SF(frameDiffMap, malloc, NULL, (sizeof(struct FrameDiff *) * frameDiffs->bufused));
-    frameDiff = NULL;
-    for (i = 0; i < frameDiffs->bufused; i++) {
-        struct FrameDiff *newFrameDiff;
-        SF(newFrameDiff, malloc, NULL, (sizeof(struct FrameDiff)));
-        newFrameDiff->next = NULL;
-        newFrameDiff->selection = 0;
-        newFrameDiff->frameNo = i;
-        newFrameDiff->frameDiff = frameDiffs->buf[i];
-        frameDiffMap[i] = newFrameDiff;
+    if (encoders <= 1)
+        return selectFrameRange(job, outputFile, 0, frameCount, spool, 0, NULL);
+
+    /* each chunk starts at a kept frame, so that it starts with a keyframe */
+    SF(chunkStarts, malloc, NULL, ((encoders + 1) * sizeof(unsigned long long)));
+    chunk = 1;
+    chunkStarts[0] = 0;
+    keptSoFar = 0;
+    for (i = 0; i < frameCount && chunk < encoders; i++) {
+        if (frameSelections[i]) continue;
+        if (keptSoFar == kept * chunk / encoders)
+            chunkStarts[chunk++] = i;
+        keptSoFar++;
+    }
+    chunkStarts[encoders] = frameCount;
+
+    SF(tmps, mkdtemp, NULL, (dir));
+    SF(chunkFiles, malloc, NULL, (encoders * sizeof(char *)));
+    SF(pids, malloc, NULL, (encoders * sizeof(pid_t)));
+    if (!spool) {
+        checksSize = encoders * (sizeof(struct ChunkCheck) + 2 * frameSize);
+        SF(checks, mmap, MAP_FAILED, (NULL, checksSize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_ANONYMOUS, -1, 0));
+        checkFrames = (unsigned char *) (checks + encoders);
+        for (chunk = 0; chunk < encoders; chunk++) {
+            checks[chunk].last = (chunk == encoders - 1);
+            checks[chunk].misaligned = 0;
+            checks[chunk].first = checkFrames + (size_t) chunk * 2 * frameSize;
+            checks[chunk].next = checks[chunk].first + frameSize;
+        }
+    }
 
-        if (frameDiff) frameDiff->next = newFrameDiff;
-        frameDiff = newFrameDiff;
+    /* encode all the chunks at once */
+    for (chunk = 0; chunk < encoders; chunk++) {
+        SF(chunkFiles[chunk], malloc, NULL, (sizeof(dir) + 32));
+        sprintf(chunkFiles[chunk], "%s/chunk%d.mkv", dir, chunk);
+        SF(pid, fork, -1, ());
+        if (pid == 0) {
+            failed = selectFrameRange(job, chunkFiles[chunk], chunkStarts[chunk],
+                                      chunkStarts[chunk + 1] - chunkStarts[chunk],
+                                      spool, 1, checks ? &checks[chunk] : NULL);
+            statsThreadDone(stats);
+            _exit(failed ? 1 : 0);
+        }
+        pids[chunk] = pid;
     }
 
-    *frameDiffMapPtr = frameDiffMap;
+    failed = 0;
+    for (chunk = 0; chunk < encoders; chunk++) {
+        char what[64];
+        snprintf(what, sizeof(what), "encoding chunk %d", chunk);
+        /* each chunk counted its own CPU time, and its ffmpegs' */
+        if (waitChild(pids[chunk], what, NULL) < 0) failed = -1;
+    }
+
+    /* each chunk must carry on exactly where the one before it ended */
+    misaligned = 0;
+    if (checks && !failed) {
+        for (chunk = 0; chunk < encoders; chunk++) {
+            if (checks[chunk].misaligned ||
+                (!checks[chunk].last &&
+                 memcmp(checks[chunk].next, checks[chunk + 1].first, frameSize))) {
+                misaligned = 1;
+                break;
+            }
+        }
+    }
+
+    /* and join them up */
+    SF(list, malloc, NULL, (sizeof(dir) + sizeof("/chunks")));
+    sprintf(list, "%s/chunks", dir);
+    if (!failed && !misaligned) {
+        SF(listf, fopen, NULL, (list, "w"));
+        for (chunk = 0; chunk < encoders; chunk++)
+            fprintf(listf, "file '%s'\n", chunkFiles[chunk]);
+        fclose(listf);
+
+        SF(pid, fork, -1, ());
+        if (pid == 0) {
+            dup2(open("/dev/null", O_RDONLY), 0);
+            SF(tmpi, execlp, -1, (ffmpegCommand, ffmpegCommand,
+                "-f", "concat",
+                "-safe", "0",
+                "-i", list,
+                "-c", "copy",
+                outputFile, NULL));
+        }
+        failed = waitChild(pid, "joining the chunks", stats);
+    }
+
+    for (chunk = 0; chunk < encoders; chunk++) {
+        unlink(chunkFiles[chunk]);
+        free(chunkFiles[chunk]);
+    }
+    unlink(list);
+    rmdir(dir);
+    free(list);
+    free(pids);
+    free(chunkFiles);
+    free(chunkStarts);
+    if (checks) munmap(checks, checksSize);
+
+    if (!failed && misaligned) {
+        fprintf(stderr, "The chunks of %s did not line up, encoding it in one piece.\n",
+                job->options.inputFile);
+        failed = selectFrameRange(job, outputFile, 0, frameCount, NULL, 0, NULL);
+    }
+    return failed;
 }
 
-/* drop frames */
-void dropFramesf(unsigned char *frameSelections, unsigned long long frameCount,
-                struct FrameDiff **frameDiffMap, unsigned long long dropFrames,
-                double clipshowDivisor)
+/* make a video of the selected frames among count frames from start. The
+ * frames go from the decoder to the encoder through pipes, and are spliced
+ * across (or to /dev/null if dropped) so they're never copied through our
+ * memory. A chunk of a larger video is forced to start with a keyframe. If
+ * it's decoded by seeking, like a motion segment, its first frame and the
+ * one after its last are kept in check, so they can be matched up with its
+ * neighbours'. */
+static int selectFrameRange(struct MrSpeedup *job, const char *outputFile,
+                            unsigned long long start, unsigned long long count,
+                            struct FrameSpool *spool, int chunk,
+                            struct ChunkCheck *check)
 {
+    char *ffmpegCommand = (char *) job->options.ffmpegCommand;
+    char *inputFile = (char *) job->options.inputFile;
+    unsigned char *frameSelections = job->frameSelections;
+    int width = job->options.width, height = job->options.height;
+    int fps = job->options.fps;
+    pid_t pidr = -1, pidw;
+    int tmpi, failed, ret;
+    int readPipe[2], writePipe[2], devNull;
+    int useSplice = 1, inputEnded = 0, ioError = 0;
+    struct StageStats *stats = statsStage(job->stats, STATS_VIDEO);
+    FILE *outf;
+    unsigned char *frame = NULL;
     unsigned long long i;
-    struct FrameDiff *frameDiff;
+    size_t frameSize = width * height * 6 / 4; /* YUV420p */
+    char fpss[sizeof(unsigned long long)*4+1];
+    char vss[sizeof(unsigned long long)*8+2];
+    char sss[64], framess[32];
+    struct Buffer_charp args;
 
-    for (i = 0; i < dropFrames; i++) {
-        struct FrameDiff *nFrame;
-        if (i % 100 == 0)
-            fprintf(stderr, "Dropping frames: %d/%d\r", (int) i, (int) dropFrames);
+    /* our ends of the pipes must not leak into the other ffmpeg */
+    SF(devNull, open, -1, ("/dev/null", O_RDWR|O_CLOEXEC));
+    SF(tmpi, pipe2, -1, (writePipe, O_CLOEXEC));
+    growPipe(writePipe[1]);
 
-        /* drop this frame */
-        frameDiff = frameDiffMap[i];
-        frameDiff->selection = 1;
-        frameSelections[frameDiff->frameNo] = 1;
+    /* get our reader ffmpeg running */
+    if (!spool) {
+        INIT_BUFFER(args);
+        WRITE_ONE_BUFFER(args, ffmpegCommand);
+        if (start) {
+            seekTime(sss, sizeof(sss), start, &job->rate);
+            WRITE_ONE_BUFFER(args, "-ss");
+            WRITE_ONE_BUFFER(args, sss);
+        }
+        WRITE_ONE_BUFFER(args, "-i");
+        WRITE_ONE_BUFFER(args, (char *) inputFile);
+        if (check && !check->last) {
+            /* one more frame, to match against the next chunk's first */
+            snprintf(framess, sizeof(framess), "%llu", count + 1);
+            WRITE_ONE_BUFFER(args, "-frames:v");
+            WRITE_ONE_BUFFER(args, framess);
+        }
+        WRITE_ONE_BUFFER(args, "-f");
+        WRITE_ONE_BUFFER(args, "rawvideo");
+        WRITE_ONE_BUFFER(args, "-pix_fmt");
+        WRITE_ONE_BUFFER(args, "yuv420p");
+        WRITE_ONE_BUFFER(args, "-y");
+        WRITE_ONE_BUFFER(args, "pipe:1");
+        WRITE_ONE_BUFFER(args, NULL);
+
+        SF(tmpi, pipe2, -1, (readPipe, O_CLOEXEC));
+        growPipe(readPipe[0]);
+        SF(pidr, fork, -1, ());
+        if (pidr == 0) {
+            dup2(devNull, 0);
+            dup2(readPipe[1], 1);
+            SF(tmpi, execvp, -1, (args.buf[0], args.buf));
+        }
+        close(readPipe[1]);
+        FREE_BUFFER(args);
+    }
+
+    /* get our writer ffmpeg running */
+    sprintf(fpss, "%d", fps);
+    sprintf(vss, "%dx%d", width, height);
+    INIT_BUFFER(args);
+    WRITE_ONE_BUFFER(args, ffmpegCommand);
+    WRITE_ONE_BUFFER(args, "-f");
+    WRITE_ONE_BUFFER(args, "rawvideo");
+    WRITE_ONE_BUFFER(args, "-pixel_format");
+    WRITE_ONE_BUFFER(args, "yuv420p");
+    WRITE_ONE_BUFFER(args, "-r");
+    WRITE_ONE_BUFFER(args, fpss);
+    WRITE_ONE_BUFFER(args, "-video_size");
+    WRITE_ONE_BUFFER(args, vss);
+    WRITE_ONE_BUFFER(args, "-i");
+    WRITE_ONE_BUFFER(args, "pipe:0");
+    WRITE_ONE_BUFFER(args, "-c:v");
+    WRITE_ONE_BUFFER(args, "libx264");
+    WRITE_ONE_BUFFER(args, "-crf");
+    WRITE_ONE_BUFFER(args, "16");
+    if (chunk) {
+        WRITE_ONE_BUFFER(args, "-force_key_frames");
+        WRITE_ONE_BUFFER(args, "expr:eq(n,0)");
+    }
+    WRITE_ONE_BUFFER(args, (char *) outputFile);
+    WRITE_ONE_BUFFER(args, NULL);
+
+    SF(pidw, fork, -1, ());
+    if (pidw == 0) {
+        dup2(writePipe[0], 0);
+        SF(tmpi, execvp, -1, (args.buf[0], args.buf));
+    }
+    close(writePipe[0]);
+    FREE_BUFFER(args);
 
-        /* find the next unskipped frame */
-        for (nFrame = frameDiff->next; nFrame; nFrame = nFrame->next) {
-            if (!nFrame->selection)
+    /* make the selection */
+    frameSelections += start;
+    if (spool) {
+        SF(outf, fdopen, NULL, (writePipe[1], "wb"));
+        SF(frame, malloc, NULL, (frameSize));
+        seekFrameSpool(spool, start);
+        for (i = 0; i < count; i++) {
+            if (readSpooledFrame(spool, frameSelections[i] ? NULL : frame) < 0) {
+                ioError = 1;
                 break;
+            }
+            if (!frameSelections[i]) {
+                unsigned long long since = statsNow();
+                if (fwrite(frame, 1, frameSize, outf) != frameSize) break;
+                STATS_SINCE(stats, writeBlocked, since);
+                STATS_ADD(stats, bytesOut, frameSize);
+            }
+            STATS_ADD(stats, frames, 1);
         }
+        fclose(outf);
 
-        if (nFrame) {
-            /* remove it */
-            int nFramePos = frameDiffBSearch(nFrame, frameDiffMap + i, frameCount - i) + i;
-            if (nFramePos == i) {
-                fprintf(stderr, "frameDiffBSearch is very broken!\n");
-                exit(1);
-            }
-            if (frameDiffMap[nFramePos] != nFrame) {
-                fprintf(stderr, "frameDiffBSearch is wrong!\n");
-                exit(1);
+    } else {
+        for (i = 0; i < count; i++) {
+            int out = frameSelections[i] ? devNull : writePipe[1];
+            if (check && i == 0) {
+                ret = readFrame(readPipe[0], check->first, frameSize);
+                if (ret == 0) ret = writeFrame(out, check->first, frameSize);
+            } else {
+                ret = forwardFrame(readPipe[0], out, frameSize, &useSplice, &frame, stats);
             }
-            memmove(frameDiffMap + nFramePos,
-                    frameDiffMap + nFramePos + 1,
-                    (frameCount - nFramePos - 1) * sizeof(struct FrameDiff *));
+            inputEnded = (ret == -1);
+            ioError = (ret == -3);
+            if (ret < 0) break;
+            STATS_ADD(stats, frames, 1);
+            STATS_ADD(stats, bytesIn, frameSize);
+            if (!frameSelections[i]) STATS_ADD(stats, bytesOut, frameSize);
+        }
 
-            /* change it */
-            if (clipshowDivisor != 0)
-                nFrame->frameDiff += frameDiff->frameDiff / clipshowDivisor;
+        /* a chunk must be followed by the next chunk's first frame, or by the
+         * end of the input if it's the last */
+        if (check && !ioError) {
+            if (inputEnded) {
+                check->misaligned = 1;
+            } else if (i == count) {
+                if (check->last) {
+                    char extra;
+                    while ((ret = read(readPipe[0], &extra, 1)) < 0 && errno == EINTR);
+                    if (ret < 0) {
+                        perror("read");
+                        ioError = 1;
+                    } else if (ret > 0) {
+                        check->misaligned = 1;
+                    }
+                    inputEnded = (ret == 0);
+                } else {
+                    ret = readFrame(readPipe[0], check->next, frameSize);
+                    if (ret == -3) ioError = 1;
+                    else if (ret < 0) check->misaligned = 1;
+                    inputEnded = 1;
+                }
+            }
+        }
+        close(readPipe[0]);
+        close(writePipe[1]);
 
-            /* and readd it */
-            nFramePos = frameDiffBSearch(nFrame, frameDiffMap + i, frameCount - i - 1) + i;
-            memmove(frameDiffMap + nFramePos + 1,
-                    frameDiffMap + nFramePos,
-                    (frameCount - nFramePos - 1) * sizeof(struct FrameDiff *));
-            frameDiffMap[nFramePos] = nFrame;
+    }
+    close(devNull);
+
+    /* the decoder may be cut off once we stop reading, so it only matters how
+     * it went if it ran out first. A chunk that came up short because its
+     * decoder failed has failed, not just misaligned. */
+    failed = 0;
+    if (pidr > 0) {
+        if (inputEnded) {
+            if (waitChild(pidr, "decoding video", stats) < 0) {
+                failed = -1;
+                if (check) check->misaligned = 0;
+            }
+        } else {
+            reapChild(pidr, stats);
         }
     }
-    fprintf(stderr, "\n");
+    if (waitChild(pidw, "encoding video", stats) < 0) failed = -1;
+    if (ioError) failed = -1;
+
+    free(frame);
+    return failed;
 }
 
-/* make a video of the selected frames */
-void selectFrames(const char *outputFile, const char *inputFile,
-                  unsigned char *frameSelections,
-                  unsigned long long frameCount,
-                  int width, int height, int fps)
+/* make a video of the selected frames with ffmpeg's select filter, so that a
+ * single ffmpeg decodes, drops and encodes, and no raw video passes through
+ * us. The kept frames are written to a filter script as runs. */
+static int selectFramesFilter(struct MrSpeedup *job)
 {
-    pid_t pidr, pidw;
-    char *tmps;
-    int tmpi;
-    FILE *inf, *outf;
-    unsigned char *frame;
-    unsigned long long i;
-    int frameSize = width * height * 6 / 4; /* YUV420p */
-    char fifor[] = "/tmp/mrspeedup.XXXXXX\0fifo";
-    char fifow[] = "/tmp/mrspeedup.XXXXXX\0fifo";
-    int fifoDirLen = strlen(fifor);
-
-    /* make our fifos */
-    SF(tmps, mkdtemp, NULL, (fifor));
-    SF(tmps, mkdtemp, NULL, (fifow));
-    fifor[fifoDirLen] = '/';
-    fifow[fifoDirLen] = '/';
-    SF(tmpi, mkfifo, -1, (fifor, 0600));
-    SF(tmpi, mkfifo, -1, (fifow, 0600));
+    const char *ffmpegCommand = job->options.ffmpegCommand;
+    const char *inputFile = job->options.inputFile;
+    const char *outputFile = job->options.outputFile;
+    unsigned char *frameSelections = job->frameSelections;
+    unsigned long long frameCount = job->frameCount;
+    int fps = job->options.fps;
+    const char *dir;
+    char *script;
+    char fpss[sizeof(int)*3+2];
+    struct Buffer_ull runs;
+    unsigned long long i, start;
+    int fd, tmpi;
+    FILE *f;
+    pid_t pid;
 
-    /* get our reader ffmpeg running */
-    SF(pidr, fork, -1, ());
-    if (pidr == 0) {
-        dup2(open("/dev/null", O_RDONLY), 0);
-        SF(tmpi, execlp, -1, (ffmpegCommand, ffmpegCommand,
-            "-i", inputFile,
-            "-f", "rawvideo",
-            "-pix_fmt", "yuv420p",
-            "-y", fifor, NULL));
+    /* find the runs of kept frames */
+    INIT_BUFFER(runs);
+    for (i = 0; i < frameCount; i++) {
+        if (frameSelections[i]) continue;
+        start = i;
+        while (i + 1 < frameCount && !frameSelections[i + 1]) i++;
+        WRITE_ONE_BUFFER(runs, start);
+        WRITE_ONE_BUFFER(runs, i);
     }
 
-    /* get our writer ffmpeg running */
-    SF(pidw, fork, -1, ());
-    if (pidw == 0) {
-        char fpss[sizeof(unsigned long long)*4+1];
-        char vss[sizeof(unsigned long long)*8+2];
-        sprintf(fpss, "%d", fps);
-        sprintf(vss, "%dx%d", width, height);
+    /* write them out as a filter, in the same place as a spool would go */
+    dir = getenv("TMPDIR");
+    if (!dir || !dir[0]) dir = "/tmp";
+    SF(script, malloc, NULL, (strlen(dir) + sizeof("/mrspeedup.XXXXXX")));
+    sprintf(script, "%s/mrspeedup.XXXXXX", dir);
+    SF(fd, mkstemp, -1, (script));
+    SF(f, fdopen, NULL, (fd, "w"));
+    fprintf(f, "select='");
+    if (runs.bufused)
+        writeSelectTree(f, runs.buf, 0, runs.bufused / 2);
+    else
+        fprintf(f, "0");
+    fprintf(f, "',setpts=N/(%d*TB)\n", fps);
+    if (fclose(f) != 0) {
+        perror(script);
+        unlink(script);
+        free(script);
+        FREE_BUFFER(runs);
+        return -1;
+    }
+    FREE_BUFFER(runs);
+
+    /* the output rate must be given too, or ffmpeg would keep the input's
+     * and duplicate frames to fill it */
+    sprintf(fpss, "%d", fps);
+
+    SF(pid, fork, -1, ());
+    if (pid == 0) {
         dup2(open("/dev/null", O_RDONLY), 0);
         SF(tmpi, execlp, -1, (ffmpegCommand, ffmpegCommand,
-            "-f", "rawvideo",
-            "-pixel_format", "yuv420p",
+            "-i", inputFile,
+            "-an",
+            "-filter_script:v", script,
             "-r", fpss,
-            "-video_size", vss,
-            "-i", fifow,
             "-c:v", "libx264",
             "-crf", "16",
             outputFile, NULL));
     }
+    tmpi = waitChild(pid, "encoding video", statsStage(job->stats, STATS_VIDEO));
 
-    /* make the selection */
-    SF(inf, fopen, NULL, (fifor, "rb"));
-    SF(outf, fopen, NULL, (fifow, "wb"));
-    SF(frame, malloc, NULL, (frameSize));
-    for (i = 0; i < frameCount && !feof(inf) && !ferror(inf); i++) {
-        /* read in the frame */
-        fread(frame, frameSize, 1, inf);
+    unlink(script);
+    free(script);
+    return tmpi;
+}
+
+/* write a select expression that's true for frames in runs [lo, hi) (pairs of
+ * first and last frame). It's a balanced tree of comparisons, so ffmpeg only
+ * evaluates O(log runs) of them per frame. */
+static void writeSelectTree(FILE *f, unsigned long long *runs, size_t lo, size_t hi)
+{
+    size_t mid;
+
+    if (hi - lo == 1) {
+        fprintf(f, "between(n,%llu,%llu)", runs[lo * 2], runs[lo * 2 + 1]);
+        return;
+    }
 
-        /* write it out unless skipped */
-        if (!frameSelections[i]) {
-            fwrite(frame, 1, frameSize, outf);
+    mid = (lo + hi) / 2;
+    fprintf(f, "if(lt(n,%llu),", runs[mid * 2]);
+    writeSelectTree(f, runs, lo, mid);
+    fprintf(f, ",");
+    writeSelectTree(f, runs, mid, hi);
+    fprintf(f, ")");
+}
+
+/* make this pipe as large as we're allowed, so that frames move through it in
+ * fewer, larger pieces. Failure just leaves it as it was. */
+static void growPipe(int fd)
+{
+    FILE *maxf;
+    int maxSize = 1024 * 1024;
+
+    if ((maxf = fopen("/proc/sys/fs/pipe-max-size", "r"))) {
+        if (fscanf(maxf, "%d", &maxSize) != 1) maxSize = 1024 * 1024;
+        fclose(maxf);
+    }
+    fcntl(fd, F_SETPIPE_SZ, maxSize);
+}
+
+/* move a frame from the pipe in to out. This splices if it can, and otherwise
+ * copies the frame through buf, allocated on first use. Returns -1 if the
+ * input ends first, -2 if the output is closed, or -3 on any other error,
+ * after saying why. */
+static int forwardFrame(int in, int out, size_t frameSize, int *useSplice,
+                        unsigned char **buf, struct StageStats *stats)
+{
+    size_t left = frameSize;
+    ssize_t moved, wr;
+    unsigned long long since;
+
+    while (left) {
+        if (*useSplice) {
+            /* a splice can block on either end, so wait for each in turn to
+             * tell which we're waiting on */
+            if (stats) {
+                pollBlocked(in, POLLIN, &stats->readBlocked);
+                pollBlocked(out, POLLOUT, &stats->writeBlocked);
+            }
+            moved = splice(in, NULL, out, NULL, left, SPLICE_F_MOVE|SPLICE_F_MORE);
+            if (moved > 0) {
+                left -= moved;
+                continue;
+            }
+            if (moved == 0) return -1;
+            if (errno == EPIPE) return -2;
+            if (errno == EINTR) continue;
+            if (errno != EINVAL && errno != ENOSYS) {
+                perror("splice");
+                return -3;
+            }
+
+            /* this kernel or this output can't splice */
+            *useSplice = 0;
+        }
+
+        if (!*buf) {
+            SF(*buf, malloc, NULL, (frameSize));
+        }
+        since = statsNow();
+        moved = read(in, *buf, left);
+        STATS_SINCE(stats, readBlocked, since);
+        if (moved == 0) return -1;
+        if (moved < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return -3;
         }
+        for (wr = 0; wr < moved; ) {
+            ssize_t wrd;
+            since = statsNow();
+            wrd = write(out, *buf + wr, moved - wr);
+            STATS_SINCE(stats, writeBlocked, since);
+            if (wrd < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EPIPE) return -2;
+                perror("write");
+                return -3;
+            }
+            wr += wrd;
+        }
+        left -= moved;
     }
-    fclose(inf);
-    fclose(outf);
 
-    waitpid(pidr, NULL, 0);
-    waitpid(pidw, NULL, 0);
+    return 0;
+}
 
-    free(frame);
-    unlink(fifor);
-    unlink(fifow);
-    fifor[fifoDirLen] = '\0';
-    fifow[fifoDirLen] = '\0';
-    rmdir(fifor);
-    rmdir(fifow);
+/* read a whole frame from the pipe in. Returns -1 if the input ends first, or
+ * -3 on an error, after saying why. */
+static int readFrame(int in, unsigned char *frame, size_t frameSize)
+{
+    size_t got = 0;
+    ssize_t rd;
+
+    while (got < frameSize) {
+        rd = read(in, frame + got, frameSize - got);
+        if (rd == 0) return -1;
+        if (rd < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return -3;
+        }
+        got += rd;
+    }
+    return 0;
+}
+
+/* write a whole frame to the pipe out. Returns -2 if it's closed, or -3 on
+ * any other error, after saying why. */
+static int writeFrame(int out, const unsigned char *frame, size_t frameSize)
+{
+    size_t put = 0;
+    ssize_t wr;
+
+    while (put < frameSize) {
+        wr = write(out, frame + put, frameSize - put);
+        if (wr < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EPIPE) return -2;
+            perror("write");
+            return -3;
+        }
+        put += wr;
+    }
+    return 0;
 }
 
-/* make the audio file */
-void mkAudioFile(const char *audioFile, const char *inputFile,
-                 unsigned char *frameSelections, unsigned long long frameCount,
-                 int fps)
+/* wait for this fd to be ready, adding the time to blocked if it wasn't */
+static void pollBlocked(int fd, short events, unsigned long long *blocked)
 {
-    char flacf[] = "/tmp/mrspeedup.XXXXXX\0a.flac";
-    int flacfLen = strlen(flacf);
+    struct pollfd pfd;
+    unsigned long long since;
 
-    char *tmps;
-    int i, tmpi;
-    unsigned long long frame;
-    pid_t pid;
-    struct Buffer_charp args, allocatedArgs;
-    double inlen, outlen, framelen;
+    pfd.fd = fd;
+    pfd.events = events;
+    if (poll(&pfd, 1, 0) != 0) return;
+
+    since = statsNow();
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+    __atomic_add_fetch(blocked, statsNow() - since, __ATOMIC_RELAXED);
+}
+
+/* make the audio file, time-stretching the input's audio to follow the
+ * selected frames */
+static int mkAudioFile(struct MrSpeedup *job)
+{
+    const char *ffmpegCommand = job->options.ffmpegCommand;
+    const char *inputFile = job->options.inputFile;
+    const char *audioFile = job->options.audioFile;
+    struct Buffer_stretchPoint map;
+    int readPipe[2], writePipe[2], devNull, tmpi, failed;
+    pid_t pidr, pidw;
+    char rates[32], channelss[32];
 
-    SF(tmps, mkdtemp, NULL, (flacf));
-    flacf[flacfLen] = '/';
+    mkStretchMap(&map, job->frameSelections, job->frameCount, job->options.fps);
+    sprintf(rates, "%d", AUDIO_RATE);
+    sprintf(channelss, "%d", AUDIO_CHANNELS);
+
+    SF(devNull, open, -1, ("/dev/null", O_RDONLY|O_CLOEXEC));
+    SF(tmpi, pipe2, -1, (readPipe, O_CLOEXEC));
+    SF(tmpi, pipe2, -1, (writePipe, O_CLOEXEC));
+    growPipe(readPipe[0]);
+    growPipe(writePipe[1]);
 
     /* get out the audio data */
-    SF(pid, fork, -1, ());
-    if (pid == 0) {
+    SF(pidr, fork, -1, ());
+    if (pidr == 0) {
+        dup2(devNull, 0);
+        dup2(readPipe[1], 1);
         SF(tmpi, execlp, -1, (ffmpegCommand, ffmpegCommand,
             "-i", inputFile,
-            flacf, NULL));
+            "-vn",
+            "-f", AUDIO_FORMAT,
+            "-ar", rates,
+            "-ac", channelss,
+            "-y", "pipe:1", NULL));
     }
-    waitpid(pid, NULL, 0);
+    close(readPipe[1]);
+
+    /* and encode it once it's stretched */
+    SF(pidw, fork, -1, ());
+    if (pidw == 0) {
+        dup2(writePipe[0], 0);
+        SF(tmpi, execlp, -1, (ffmpegCommand, ffmpegCommand,
+            "-f", AUDIO_FORMAT,
+            "-ar", rates,
+            "-ac", channelss,
+            "-i", "pipe:0",
+            "-y", audioFile, NULL));
+    }
+    close(writePipe[0]);
+
+    failed = 0;
+    if (timeStretch(readPipe[0], writePipe[1], AUDIO_RATE, AUDIO_CHANNELS,
+                    map.buf, map.bufused, statsStage(job->stats, STATS_AUDIO)) < 0) {
+        /* a closed pipe is the encoder failing, which it will tell us */
+        if (errno != EPIPE) perror("audio");
+        failed = -1;
+    }
+    close(readPipe[0]);
+    close(writePipe[1]);
+    close(devNull);
 
-    /* make the sox command */
+    /* the decoder is cut off at the end of the map, so how it went doesn't
+     * matter */
+    reapChild(pidr, statsStage(job->stats, STATS_AUDIO));
+    if (waitChild(pidw, "encoding audio", statsStage(job->stats, STATS_AUDIO)) < 0) failed = -1;
+
+    FREE_BUFFER(map);
+    return failed;
+}
+
+/* the time map for stretching audio to the selected frames. Like the sox
+ * chain, it's in pieces of at least 0.1 seconds of output, so the tempo
+ * changes smoothly. Dropped frames after the last kept frame have no output,
+ * so they're left off the end. */
+static void mkStretchMap(struct Buffer_stretchPoint *map, unsigned char *frameSelections,
+                         unsigned long long frameCount, int fps)
+{
+    unsigned long long frame, inFrames = 0, outFrames = 0, lastOutFrames = 0;
+    struct StretchPoint point;
+
+    INIT_BUFFER(*map);
+    for (frame = 0; frame < frameCount; frame++) {
+        inFrames++;
+        if (!frameSelections[frame]) outFrames++;
+
+        if ((outFrames - lastOutFrames >= fps / 10.0 || frame == frameCount - 1) &&
+            outFrames > lastOutFrames) {
+            point.in = (double) inFrames / fps;
+            point.out = (double) outFrames / fps;
+            WRITE_ONE_BUFFER(*map, point);
+            lastOutFrames = outFrames;
+        }
+    }
+}
+
+/* make the audio file with a sox effects chain */
+static int mkAudioFileSox(struct MrSpeedup *job)
+{
+    const char *ffmpegCommand = job->options.ffmpegCommand;
+    const char *inputFile = job->options.inputFile;
+    const char *audioFile = job->options.audioFile;
+    unsigned char *frameSelections = job->frameSelections;
+    unsigned long long frameCount = job->frameCount;
+    int fps = job->options.fps;
+    int i, tmpi, failed;
+    int readPipe[2], devNull;
+    unsigned long long frame;
+    pid_t pidr, pid;
+    struct Buffer_charp args, allocatedArgs;
+    double inlen, outlen, framelen;
+    char rates[32], channelss[32];
+
+    sprintf(rates, "%d", AUDIO_RATE);
+    sprintf(channelss, "%d", AUDIO_CHANNELS);
+
+    /* make the sox command. The audio comes in as raw PCM on stdin, in our
+     * byte order, which is sox's default. */
     INIT_BUFFER(args);
     INIT_BUFFER(allocatedArgs);
 
     WRITE_ONE_BUFFER(args, "sox");
-    WRITE_ONE_BUFFER(args, (char *) flacf);
+    WRITE_ONE_BUFFER(args, "-t");
+    WRITE_ONE_BUFFER(args, "raw");
+    WRITE_ONE_BUFFER(args, "-r");
+    WRITE_ONE_BUFFER(args, rates);
+    WRITE_ONE_BUFFER(args, "-e");
+    WRITE_ONE_BUFFER(args, "signed-integer");
+    WRITE_ONE_BUFFER(args, "-b");
+    WRITE_ONE_BUFFER(args, "16");
+    WRITE_ONE_BUFFER(args, "-c");
+    WRITE_ONE_BUFFER(args, channelss);
+    WRITE_ONE_BUFFER(args, "-");
     WRITE_ONE_BUFFER(args, (char *) audioFile);
 
     framelen = 1.0 / fps;
@@ -685,20 +2032,222 @@ void mkAudioFile(const char *audioFile, const char *inputFile,
     WRITE_ONE_BUFFER(args, "0");
     WRITE_ONE_BUFFER(args, NULL);
 
+    /* stream the audio data straight from ffmpeg into sox, so that it's
+     * stretched as it's extracted */
+    SF(devNull, open, -1, ("/dev/null", O_RDONLY|O_CLOEXEC));
+    SF(tmpi, pipe2, -1, (readPipe, O_CLOEXEC));
+    growPipe(readPipe[0]);
+
+    SF(pidr, fork, -1, ());
+    if (pidr == 0) {
+        dup2(devNull, 0);
+        dup2(readPipe[1], 1);
+        SF(tmpi, execlp, -1, (ffmpegCommand, ffmpegCommand,
+            "-i", inputFile,
+            "-vn",
+            "-f", AUDIO_FORMAT,
+            "-ar", rates,
+            "-ac", channelss,
+            "-y", "pipe:1", NULL));
+    }
+    close(readPipe[1]);
+
     SF(pid, fork, -1, ());
     if (pid == 0) {
         /* run sox */
+        dup2(readPipe[0], 0);
         SF(tmpi, execvp, -1, (args.buf[0], args.buf));
     }
-    waitpid(pid, NULL, 0);
+    close(readPipe[0]);
+    close(devNull);
+
+    /* sox stops reading at the end of its chain, so how the decoder went
+     * doesn't matter */
+    failed = waitChild(pid, "sox", statsStage(job->stats, STATS_AUDIO));
+    reapChild(pidr, statsStage(job->stats, STATS_AUDIO));
 
     for (i = 0; i < allocatedArgs.bufused; i++)
         free(allocatedArgs.buf[i]);
 
     FREE_BUFFER(allocatedArgs);
     FREE_BUFFER(args);
+    return failed;
+}
+
+/* wait for a child process, saying so if it failed, and add its CPU time to
+ * stats. Returns -1 on failure. */
+static int waitChild(pid_t pid, const char *what, struct StageStats *stats)
+{
+    struct rusage usage;
+    int status;
+
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            perror("wait4");
+            return -1;
+        }
+    }
+
+    statsChildDone(stats, &usage);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return 0;
+
+    if (WIFEXITED(status))
+        fprintf(stderr, "%s failed with status %d\n", what, WEXITSTATUS(status));
+    else
+        fprintf(stderr, "%s was killed by signal %d\n", what, WTERMSIG(status));
+    return -1;
+}
+
+/* wait for a child process whose exit status doesn't matter, adding its CPU
+ * time to stats */
+static void reapChild(pid_t pid, struct StageStats *stats)
+{
+    struct rusage usage;
+
+    while (wait4(pid, NULL, 0, &usage) < 0) {
+        if (errno != EINTR) return;
+    }
+    statsChildDone(stats, &usage);
+}
+
+/* start an output stage in its own process group, so that if one fails, the
+ * others can be stopped along with all their ffmpegs. done is set to a pipe
+ * that reaches EOF when the stage exits. */
+static pid_t startStage(struct MrSpeedup *job, int (*stage)(struct MrSpeedup *), int *done)
+{
+    int pipefd[2], tmpi;
+    pid_t pid;
+    struct sigaction sa;
+
+    SF(tmpi, pipe2, -1, (pipefd, O_CLOEXEC));
+    SF(pid, fork, -1, ());
+    if (pid == 0) {
+        setpgid(0, 0);
+        close(pipefd[0]);
+
+        /* whatever the caller does with signals isn't for us. A closed pipe
+         * is left to show up as EPIPE, so that we go on to report why the
+         * ffmpeg on the other end failed. The handler, unlike SIG_IGN, isn't
+         * inherited by the ffmpegs we run. */
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = ignoreSignal;
+        sigaction(SIGPIPE, &sa, NULL);
+
+        _exit(stage(job) < 0 ? 1 : 0);
+    }
+    setpgid(pid, pid);
+    close(pipefd[1]);
+    *done = pipefd[0];
+    return pid;
+}
+
+/* wait for the output stages. Only they are waited for, as the caller may
+ * have children of its own, so their pipes tell us when one's exiting. Those
+ * may leak into a process another thread forks at just the wrong time, so we
+ * look for exited stages every second as well. If one fails, the rest are
+ * stopped. Returns -1 if any failed. */
+static int superviseStages(struct MrSpeedup *job, pid_t *pids, int *done,
+                           const char **names, int count)
+{
+    struct pollfd pfds[2];
+    int running = count, failed = 0, status, ready, i, j;
+    pid_t pid;
 
-    unlink(flacf);
-    flacf[flacfLen] = '\0';
-    rmdir(flacf);
+    while (running) {
+        for (i = 0; i < count; i++) {
+            pfds[i].fd = (pids[i] > 0) ? done[i] : -1;
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+        ready = poll(pfds, count, 1000);
+
+        for (i = 0; i < count; i++) {
+            if (pids[i] <= 0) continue;
+
+            /* at EOF it's exiting, so it's worth waiting for */
+            while ((pid = waitpid(pids[i], &status,
+                                  (ready > 0 && pfds[i].revents) ? 0 : WNOHANG)) < 0 &&
+                   errno == EINTR);
+            if (pid == 0) continue;
+            close(done[i]);
+            pids[i] = job->stageGroups[i] = 0;
+            running--;
+
+            if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) continue;
+            if (failed) continue; /* we stopped it */
+            if (pid < 0)
+                perror("waitpid");
+            else if (WIFSIGNALED(status))
+                fprintf(stderr, "Making the %s was killed by signal %d\n", names[i],
+                        WTERMSIG(status));
+            else
+                fprintf(stderr, "Making the %s failed\n", names[i]);
+
+            /* stop everything else */
+            failed = -1;
+            for (j = 0; j < count; j++)
+                if (pids[j] > 0) kill(-pids[j], SIGTERM);
+        }
+    }
+
+    return failed;
+}
+
+static void ignoreSignal(int sig)
+{
+}
+
+/* the video output stage */
+static int renderVideo(struct MrSpeedup *job)
+{
+    struct StageStats *stats = statsStage(job->stats, STATS_VIDEO);
+    int failed;
+
+    statsStart(stats);
+    if (job->options.ffmpegSelect)
+        failed = selectFramesFilter(job);
+    else
+        failed = selectFrames(job);
+    statsStop(stats);
+    return failed;
+}
+
+/* the audio output stage */
+static int renderAudio(struct MrSpeedup *job)
+{
+    struct StageStats *stats = statsStage(job->stats, STATS_AUDIO);
+    int failed;
+
+    statsStart(stats);
+    if (job->options.audioEngine == AUDIO_SOX)
+        failed = mkAudioFileSox(job);
+    else
+        failed = mkAudioFile(job);
+    statsStop(stats);
+    STATS_ADD(stats, frames, job->frameCount);
+    return failed;
+}
+
+/* mux the video and audio into one file */
+static int muxOutput(struct MrSpeedup *job)
+{
+    const char *ffmpegCommand = job->options.ffmpegCommand;
+    pid_t pid;
+    int tmpi;
+
+    SF(pid, fork, -1, ());
+    if (pid == 0) {
+        dup2(open("/dev/null", O_RDONLY), 0);
+        SF(tmpi, execlp, -1, (ffmpegCommand, ffmpegCommand,
+            "-i", job->options.outputFile,
+            "-i", job->options.audioFile,
+            "-map", "0:v",
+            "-map", "1:a",
+            "-c", "copy",
+            "-y", job->options.muxFile, NULL));
+    }
+    return waitChild(pid, "muxing", statsStage(job->stats, STATS_MUX));
 }
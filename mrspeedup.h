@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MRSPEEDUP_H
+#define MRSPEEDUP_H
+
+#include <stdio.h>
+
+#include "motionfile.h"
+#include "selection.h"
+
+/* libmrspeedup: speed up a video by dropping its least interesting frames.
+ *
+ * A job is a struct MrSpeedup made from options, taken through its stages in
+ * order: mrspeedupAnalyze gets the motion data (from a motion file, the cache,
+ * or by decoding the input), mrspeedupSelect chooses the frames to drop, and
+ * mrspeedupRender writes the output video, audio and mux. Each returns
+ * MRSPEEDUP_OK or a (negative) error code, having said why on stderr. Jobs
+ * share no state, so several may run at once in different threads.
+ *
+ * The work is done by child processes (ffmpeg, sox, and forks of this one for
+ * the output stages), which are only ever waited for by pid. Running out of
+ * memory or failing to create a pipe or process still exits. */
+
+enum MrSpeedupError {
+    MRSPEEDUP_OK = 0,
+    MRSPEEDUP_EINVAL = -1, /* the options are invalid */
+    MRSPEEDUP_EORDER = -2, /* a stage was run before the stage it needs */
+    MRSPEEDUP_EMOTION = -3, /* the motion data file can't be used */
+    MRSPEEDUP_EINPUT = -4, /* the input could not be decoded */
+    MRSPEEDUP_EOUTPUT = -5 /* making the output failed */
+};
+
+/* how to time-stretch the audio */
+enum AudioEngine {
+    AUDIO_NATIVE,
+    AUDIO_SOX
+};
+
+struct MrSpeedupOptions {
+    const char *inputFile;
+    const char *outputFile; /* needed to render */
+    const char *audioFile; /* also write the audio here, or NULL */
+    const char *muxFile; /* and mux it with the video here, or NULL */
+    const char *motionFile; /* to read motion data from, or write it to, or NULL */
+    const char *ffmpegCommand, *ffprobeCommand;
+
+    int width, height, fps;
+    int motionWidth, motionHeight; /* 0 for motionScale */
+    int motionScale;
+    double sampleBound; /* adaptive sampling error bound, 0 for exact */
+    enum MotionMetric metric;
+    int metricThreshold; /* for MOTION_METRIC_CHANGED, 0 to 255 */
+    int threads; /* 0 for one per CPU */
+    int segments;
+    int checkpointSeconds;
+
+    const char *cacheDir; /* NULL for the default */
+    int noCache;
+    unsigned long long cacheSize; /* in bytes */
+
+    int singleDecode; /* spool the frames decoded for analysis, for rendering */
+    const char *spoolDir;
+    unsigned long long spoolSize; /* in bytes */
+    int spoolCompress;
+
+    /* only one of these should be set */
+    int speedup;
+    unsigned long long dropFrames, keepFrames;
+
+    int windowSize; /* 0 for a third of a second */
+    enum WindowKernel windowKernel;
+    double clipshowDivisor;
+
+    int ffmpegSelect;
+    int encoders;
+    enum AudioEngine audioEngine;
+
+    int stats; /* keep statistics for mrspeedupWriteStats */
+};
+
+struct MrSpeedup;
+
+/* fill in the default options */
+void mrspeedupDefaultOptions(struct MrSpeedupOptions *options);
+
+/* make a job with these options, which are copied, though the strings they
+ * point to are not */
+int mrspeedupNew(struct MrSpeedup **job, const struct MrSpeedupOptions *options);
+
+/* get the motion data */
+int mrspeedupAnalyze(struct MrSpeedup *job);
+
+/* choose the frames to drop */
+int mrspeedupSelect(struct MrSpeedup *job);
+
+/* write the output video, and the audio and mux if requested */
+int mrspeedupRender(struct MrSpeedup *job);
+
+/* the motion data, after analysis (or, after selection, as adjusted by it) */
+const double *mrspeedupFrameDiffs(struct MrSpeedup *job, unsigned long long *frameCount);
+
+/* the frame selections after selection, 1 for each frame dropped */
+const unsigned char *mrspeedupFrameSelections(struct MrSpeedup *job,
+                                              unsigned long long *frameCount);
+
+/* write a JSON report of the job's statistics, if it kept them. failed is
+ * reported as whether the job failed. Returns -1 on error. */
+int mrspeedupWriteStats(struct MrSpeedup *job, FILE *out, int failed);
+
+/* send this signal to the job's running output stages and their children. Safe
+ * to call from a signal handler. */
+void mrspeedupInterrupt(struct MrSpeedup *job, int sig);
+
+/* free the job */
+void mrspeedupFree(struct MrSpeedup *job);
+
+/* a job to run in a batch, and how it went */
+struct MrSpeedupBatchJob {
+    struct MrSpeedupOptions options;
+    int analyzeOnly; /* don't select or render */
+    const char *statsFile; /* write the statistics report here, "-" for stdout */
+
+    /* set as it runs */
+    int status; /* MRSPEEDUP_OK or the error it stopped with */
+    unsigned long long frames, keptFrames;
+    double seconds, waitSeconds; /* in all, and waiting for the scheduler */
+    struct MrSpeedup *volatile rendering; /* while rendering, for mrspeedupInterrupt */
+};
+
+/* run a batch of jobs, in order but overlapping: at most decoders of them
+ * analyzing and encoders' worth of them rendering at once. A job rendering with
+ * more than one encoder takes that many (or all) of them. A job's analysis
+ * threads, if not given, are the CPUs shared out among the decoders. Returns
+ * the number of jobs that failed. */
+int mrspeedupRunBatch(struct MrSpeedupBatchJob *jobs, size_t count,
+                      int decoders, int encoders);
+
+/* describe an error code */
+const char *mrspeedupStrerror(int err);
+
+#endif
@@ -1,24 +1,588 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "arg.h"
 #include "buffer.h"
+#include "helpers.h"
+#include "motionfile.h"
+#include "selection.h"
+
+/* Inspect motion data without decoding any video: summarize it, export all or
+ * part of it (optionally downsampled), or preview which frames a speedup would
+ * keep. The diffs are mapped, not read, so only what's looked at is paged in. */
+
+#define HISTOGRAM_WIDTH 50 /* characters in the longest histogram bar */
+
+struct ReadOptions {
+    int export, preview, binary, logBins;
+    unsigned long long first, last; /* inclusive, last clamped to the data */
+    unsigned long long buckets;
+    int histogram;
+    const char *percentiles;
+    int fps;
 
-BUFFER(double, double);
+    /* selection, as for mrspeedup */
+    int speedup;
+    unsigned long long dropFrames, keepFrames;
+    int windowSize;
+    enum WindowKernel windowKernel;
+    double clipshowDivisor;
+};
 
-/* FIXME: assumes YUV420p */
+void usage();
+int parseRange(const char *arg, struct ReadOptions *opts);
+void printSummary(struct MotionFile *motion, struct ReadOptions *opts);
+void printPercentiles(const double *frameDiffs, unsigned long long count,
+                      const char *percentiles);
+void printHistogram(const double *frameDiffs, unsigned long long count,
+                    double min, double max, int bins, int logBins);
+double selectNth(double *vals, unsigned long long lo, unsigned long long hi,
+                 unsigned long long k);
+int doubleCmp(const void *lvp, const void *rvp);
+int exportSeries(const double *frameDiffs, unsigned long long frameCount,
+                 struct ReadOptions *opts);
+int previewSelection(struct MotionFile *motion, struct ReadOptions *opts);
 
 int main(int argc, char **argv)
+{
+    ARG_VARS;
+
+    struct ReadOptions opts;
+    struct MotionFile motion;
+    const char *path = "/dev/stdin";
+    int ret = 0;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.last = (unsigned long long) -1;
+    opts.percentiles = "1,5,25,50,75,95,99";
+    opts.windowSize = 1;
+    opts.windowKernel = WINDOW_BOX;
+    opts.clipshowDivisor = 1;
+
+    /* read in our arguments */
+    ARG_NEXT();
+    while (argType) {
+        if (argType != ARG_VAL) {
+            ARGV(e, export, opts.export)
+            ARGV(p, preview, opts.preview)
+            ARGLV(binary, opts.binary)
+            ARGLV(log-bins, opts.logBins)
+            ARGLNV(percentiles, opts.percentiles)
+            ARGLN(range) {
+                ARG_GET();
+                if (parseRange(arg, &opts) < 0) {
+                    usage();
+                    exit(1);
+                }
+            } else ARGLN(buckets) {
+                ARG_GET();
+                opts.buckets = atoll(arg);
+            } else ARGLN(histogram) {
+                ARG_GET();
+                opts.histogram = atoi(arg);
+            } else ARGLN(fps) {
+                ARG_GET();
+                opts.fps = atoi(arg);
+            } else ARGN(s, speedup) {
+                ARG_GET();
+                opts.speedup = atoi(arg);
+            } else ARGLN(drop-frames) {
+                ARG_GET();
+                opts.dropFrames = atoll(arg);
+            } else ARGLN(keep-frames) {
+                ARG_GET();
+                opts.keepFrames = atoll(arg);
+            } else ARGLN(window) {
+                ARG_GET();
+                opts.windowSize = atoi(arg);
+            } else ARGLN(window-kernel) {
+                ARG_GET();
+                if (!strcmp(arg, "box")) {
+                    opts.windowKernel = WINDOW_BOX;
+                } else if (!strcmp(arg, "triangle")) {
+                    opts.windowKernel = WINDOW_TRIANGLE;
+                } else if (!strcmp(arg, "exponential")) {
+                    opts.windowKernel = WINDOW_EXPONENTIAL;
+                } else {
+                    usage();
+                    exit(1);
+                }
+            } else ARGLN(clipshow-divisor) {
+                ARG_GET();
+                opts.clipshowDivisor = atof(arg);
+            } else ARG(?, help) {
+                usage();
+                exit(0);
+            } else {
+                usage();
+                exit(1);
+            }
+        } else {
+            path = arg;
+        }
+        ARG_NEXT();
+    }
+
+    if (opts.histogram < 0 || opts.fps < 0 || opts.windowSize < 0 ||
+        (opts.binary && !opts.export)) {
+        usage();
+        exit(1);
+    }
+
+    switch (openMotionFile(&motion, path)) {
+        case -1:
+            perror(path);
+            return 1;
+        case -2:
+            return 1;
+    }
+    if (!opts.fps) opts.fps = motion.header.fps ? motion.header.fps : 30;
+
+    /* large exports go out in large writes */
+    setvbuf(stdout, NULL, _IOFBF, 1024 * 1024);
+
+    if (opts.preview) {
+        ret = previewSelection(&motion, &opts);
+    } else if (opts.export) {
+        ret = exportSeries(motion.frameDiffs, motion.header.frameCount, &opts);
+    } else {
+        printSummary(&motion, &opts);
+    }
+
+    if (fflush(stdout) != 0) {
+        perror("stdout");
+        ret = 1;
+    }
+    closeMotionFile(&motion);
+
+    return ret;
+}
+
+void usage()
+{
+    fprintf(stderr, "Use: readmotion [options] [motion file]\n"
+        "Summarizes motion data, or with -e exports it. Reads standard input if no\n"
+        "file is given.\n"
+        "Options:\n"
+        "\t--percentiles <list>\n"
+        "\t\tComma-separated percentiles for the summary. Default\n"
+        "\t\t1,5,25,50,75,95,99.\n"
+        "\t--histogram <#>\n"
+        "\t\tAlso print a histogram of the diffs with this many bins.\n"
+        "\t--log-bins\n"
+        "\t\tSpace the histogram's bins evenly in log(1 + diff) rather than\n"
+        "\t\tdiff, since most frames have little motion.\n"
+        "\t-e|--export\n"
+        "\t\tPrint the diffs, one per line, instead of a summary.\n"
+        "\t--range <first>-<last>\n"
+        "\t\tExport only these frames, counting from 0. Either end may be left\n"
+        "\t\tout. Default all.\n"
+        "\t--buckets <#>\n"
+        "\t\tExport this many equal runs of frames instead of every frame,\n"
+        "\t\teach as its first frame and the minimum, maximum and mean of its\n"
+        "\t\tdiffs.\n"
+        "\t--binary\n"
+        "\t\tExport native doubles instead of text: one per frame, or the\n"
+        "\t\tminimum, maximum and mean of each bucket.\n"
+        "\t-p|--preview\n"
+        "\t\tSummarize which frames mrspeedup would keep with the following\n"
+        "\t\toptions, which mean the same as for mrspeedup. With -e, export\n"
+        "\t\t1 for each kept frame and 0 for each dropped one instead of the\n"
+        "\t\tdiffs, so a bucket's mean is the fraction of it that's kept.\n"
+        "\t-s|--speedup <speedup>\n"
+        "\t--drop-frames <#>\n"
+        "\t--keep-frames <#>\n"
+        "\t--window <#>\n"
+        "\t--window-kernel {box|triangle|exponential}\n"
+        "\t--clipshow-divisor <#>\n"
+        "\t--fps <#>\n"
+        "\t\tVideo FPS, for times and --window 0. Default the motion data's,\n"
+        "\t\tor 30 for old files.\n");
+}
+
+/* parse a --range of the form first-last, either of which may be empty */
+int parseRange(const char *arg, struct ReadOptions *opts)
+{
+    const char *dash = strchr(arg, '-');
+    char *end;
+
+    if (!dash) return -1;
+
+    opts->first = 0;
+    if (dash != arg) {
+        opts->first = strtoull(arg, &end, 10);
+        if (end != dash) return -1;
+    }
+
+    opts->last = (unsigned long long) -1;
+    if (dash[1]) {
+        opts->last = strtoull(dash + 1, &end, 10);
+        if (*end || opts->last < opts->first) return -1;
+    }
+
+    return 0;
+}
+
+/* the header, then the distribution of the diffs */
+void printSummary(struct MotionFile *motion, struct ReadOptions *opts)
+{
+    struct MotionHeader *header = &motion->header;
+    const double *frameDiffs = motion->frameDiffs;
+    unsigned long long count = header->frameCount, i, minFrame = 0, maxFrame = 0,
+                       zeros = 0;
+    double min, max, mean, variance;
+    long double sum = 0, sumSquares = 0;
+
+    if (motion->legacy) {
+        printf("format: old, no header\n");
+    } else {
+        printf("version: %u\n", (unsigned) header->version);
+        printf("metric: %s\n", motionMetricName(header->metric));
+        if (header->metric == MOTION_METRIC_CHANGED)
+            printf("change threshold: %u\n", (unsigned) header->metricThreshold);
+        printf("size: %ux%u\n", (unsigned) header->width, (unsigned) header->height);
+        if (header->motionWidth)
+            printf("motion size: %ux%u\n", (unsigned) MOTION_WIDTH(header),
+                   (unsigned) MOTION_HEIGHT(header));
+        if (header->rateNum)
+            printf("frame rate: %u/%u\n", (unsigned) header->rateNum,
+                   (unsigned) header->rateDen);
+        if (header->sampleBound)
+            printf("adaptive: %g\n", header->sampleBound);
+        if (header->flags & MOTION_INCOMPLETE)
+            printf("incomplete: checkpointed at frame %llu\n", count);
+    }
+    printf("frames: %llu\n", count);
+    printf("duration: %.3f seconds at %d fps\n", (double) count / opts->fps, opts->fps);
+    if (!count) return;
+
+    min = max = frameDiffs[0];
+    for (i = 0; i < count; i++) {
+        double diff = frameDiffs[i];
+        if (diff < min) {
+            min = diff;
+            minFrame = i;
+        }
+        if (diff > max) {
+            max = diff;
+            maxFrame = i;
+        }
+        if (diff == 0) zeros++;
+        sum += diff;
+        sumSquares += (long double) diff * diff;
+    }
+    mean = sum / count;
+    variance = sumSquares / count - (long double) mean * mean;
+
+    printf("min: %f (frame %llu)\n", min, minFrame);
+    printf("max: %f (frame %llu)\n", max, maxFrame);
+    printf("mean: %f\n", mean);
+    printf("stddev: %f\n", variance > 0 ? sqrt(variance) : 0);
+    printf("still frames: %llu (%.2f%%)\n", zeros, 100.0 * zeros / count);
+
+    printPercentiles(frameDiffs, count, opts->percentiles);
+    if (opts->histogram)
+        printHistogram(frameDiffs, count, min, max, opts->histogram, opts->logBins);
+}
+
+/* percentiles, interpolated between the diffs on either side. Each is selected
+ * in place from a copy rather than sorting it, and since they're taken in
+ * order, each only looks at what's above the last. */
+void printPercentiles(const double *frameDiffs, unsigned long long count,
+                      const char *percentiles)
+{
+    struct Buffer_double ps;
+    double *vals, p, pos, lower, upper;
+    unsigned long long k, lo = 0, i;
+    const char *cur;
+    char *end;
+    size_t pi;
+
+    INIT_BUFFER(ps);
+    for (cur = percentiles; *cur; cur = end + (*end == ',')) {
+        p = strtod(cur, &end);
+        if (end == cur || (*end && *end != ',') || p < 0 || p > 100) {
+            fprintf(stderr, "Invalid percentiles: %s\n", percentiles);
+            FREE_BUFFER(ps);
+            return;
+        }
+        WRITE_ONE_BUFFER(ps, p);
+    }
+    if (!ps.bufused) {
+        FREE_BUFFER(ps);
+        return;
+    }
+    qsort(ps.buf, ps.bufused, sizeof(double), doubleCmp);
+
+    SF(vals, malloc, NULL, (count * sizeof(double)));
+    memcpy(vals, frameDiffs, count * sizeof(double));
+
+    printf("percentiles:\n");
+    for (pi = 0; pi < ps.bufused; pi++) {
+        pos = ps.buf[pi] / 100 * (count - 1);
+        k = pos;
+        lower = selectNth(vals, lo, count, k);
+        lo = k;
+
+        /* everything above k is at least lower, so the next is the least */
+        upper = lower;
+        if (k + 1 < count) {
+            upper = vals[k + 1];
+            for (i = k + 2; i < count; i++)
+                if (vals[i] < upper) upper = vals[i];
+        }
+
+        printf("\t%g: %f\n", ps.buf[pi], lower + (upper - lower) * (pos - k));
+    }
+
+    free(vals);
+    FREE_BUFFER(ps);
+}
+
+/* a histogram, with bars scaled to the fullest bin */
+void printHistogram(const double *frameDiffs, unsigned long long count,
+                    double min, double max, int bins, int logBins)
+{
+    unsigned long long *counts, most = 0, i;
+    double lo, hi, scale;
+    int bin, bar;
+
+    /* log bins need nonnegative diffs, which every metric gives */
+    if (min < 0) logBins = 0;
+    lo = logBins ? log1p(min) : min;
+    hi = logBins ? log1p(max) : max;
+    scale = (hi > lo) ? bins / (hi - lo) : 0;
+
+    SF(counts, calloc, NULL, (bins, sizeof(unsigned long long)));
+    for (i = 0; i < count; i++) {
+        double val = logBins ? log1p(frameDiffs[i]) : frameDiffs[i];
+        bin = (val - lo) * scale;
+        if (bin >= bins) bin = bins - 1;
+        if (bin < 0) bin = 0;
+        counts[bin]++;
+    }
+    for (bin = 0; bin < bins; bin++)
+        if (counts[bin] > most) most = counts[bin];
+
+    printf("histogram:\n");
+    for (bin = 0; bin < bins; bin++) {
+        double from = lo + (hi - lo) * bin / bins, to = lo + (hi - lo) * (bin + 1) / bins;
+        if (logBins) {
+            from = expm1(from);
+            to = expm1(to);
+        }
+        printf("\t%12g - %-12g %12llu ", from, to, counts[bin]);
+        for (bar = 0; bar < (int) (counts[bin] * HISTOGRAM_WIDTH / most); bar++)
+            putchar('#');
+        putchar('\n');
+    }
+
+    free(counts);
+}
+
+/* put the k'th least of vals[lo..hi) in its place, with everything before it
+ * no greater and everything after it no less, and return it */
+double selectNth(double *vals, unsigned long long lo, unsigned long long hi,
+                 unsigned long long k)
+{
+    unsigned long long l, r;
+    double pivot, tmp;
+
+    hi--;
+    while (lo < hi) {
+        /* median of three, to stay fast on sorted data */
+        unsigned long long mid = lo + (hi - lo) / 2;
+        if (vals[mid] < vals[lo]) { tmp = vals[mid]; vals[mid] = vals[lo]; vals[lo] = tmp; }
+        if (vals[hi] < vals[lo]) { tmp = vals[hi]; vals[hi] = vals[lo]; vals[lo] = tmp; }
+        if (vals[hi] < vals[mid]) { tmp = vals[hi]; vals[hi] = vals[mid]; vals[mid] = tmp; }
+        pivot = vals[mid];
+
+        l = lo;
+        r = hi;
+        while (l <= r) {
+            while (vals[l] < pivot) l++;
+            while (vals[r] > pivot) r--;
+            if (l <= r) {
+                tmp = vals[l];
+                vals[l] = vals[r];
+                vals[r] = tmp;
+                l++;
+                if (r == 0) break;
+                r--;
+            }
+        }
+
+        if (k <= r) {
+            hi = r;
+        } else if (k >= l) {
+            lo = l;
+        } else {
+            break;
+        }
+    }
+
+    return vals[k];
+}
+
+/* compare doubles for qsort */
+int doubleCmp(const void *lvp, const void *rvp)
+{
+    double l = *(const double *) lvp, r = *(const double *) rvp;
+    return (l < r) ? -1 : (l > r);
+}
+
+/* print the range of the series, each value or bucketed. Returns 1 if the
+ * range is past the end. */
+int exportSeries(const double *frameDiffs, unsigned long long frameCount,
+                 struct ReadOptions *opts)
+{
+    unsigned long long count, bucket, start, end, i;
+
+    if (!frameCount) return 0;
+    if (opts->first >= frameCount) {
+        fprintf(stderr, "The range starts past the last frame, %llu.\n", frameCount - 1);
+        return 1;
+    }
+    if (opts->last >= frameCount) opts->last = frameCount - 1;
+    count = opts->last - opts->first + 1;
+
+    if (!opts->buckets) {
+        if (opts->binary) {
+            fwrite(frameDiffs + opts->first, sizeof(double), count, stdout);
+        } else {
+            for (i = opts->first; i <= opts->last; i++)
+                printf("%f\n", frameDiffs[i]);
+        }
+        return 0;
+    }
+
+    if (opts->buckets > count) opts->buckets = count;
+    for (bucket = 0; bucket < opts->buckets; bucket++) {
+        double minMaxMean[3];
+        long double sum = 0;
+        start = opts->first + count * bucket / opts->buckets;
+        end = opts->first + count * (bucket + 1) / opts->buckets;
+
+        minMaxMean[0] = minMaxMean[1] = frameDiffs[start];
+        for (i = start; i < end; i++) {
+            double diff = frameDiffs[i];
+            if (diff < minMaxMean[0]) minMaxMean[0] = diff;
+            if (diff > minMaxMean[1]) minMaxMean[1] = diff;
+            sum += diff;
+        }
+        minMaxMean[2] = sum / (end - start);
+
+        if (opts->binary) {
+            fwrite(minMaxMean, sizeof(double), 3, stdout);
+        } else {
+            printf("%llu %f %f %f\n", start, minMaxMean[0], minMaxMean[1],
+                   minMaxMean[2]);
+        }
+    }
+
+    return 0;
+}
+
+/* select frames as mrspeedup would, then summarize or export the selection */
+int previewSelection(struct MotionFile *motion, struct ReadOptions *opts)
 {
     struct Buffer_double frameDiffs;
-    int i;
+    struct FrameTable frameTable;
+    unsigned char *frameSelections;
+    unsigned long long frameCount = motion->header.frameCount,
+                       dropFrames = opts->dropFrames, kept, runs, i, runStart;
+    unsigned long long longestKept = 0, longestKeptAt = 0,
+                       longestDropped = 0, longestDroppedAt = 0;
+    int windowSize = opts->windowSize;
+
+    if (opts->speedup < 0 ||
+        !!opts->speedup + !!opts->dropFrames + !!opts->keepFrames != 1) {
+        fprintf(stderr, "Exactly one of a speedup, a number of frames to drop or a number\n"
+                        "of frames to keep is needed to select frames.\n");
+        return 1;
+    }
+
+    /* now calculate the number of frames we need to drop */
+    if (opts->speedup) {
+        dropFrames = frameCount * (opts->speedup - 1) / opts->speedup;
+    } else if (opts->keepFrames) {
+        dropFrames = frameCount - opts->keepFrames;
+    }
+    if (dropFrames > frameCount) dropFrames = frameCount;
+
+    /* the diffs are mapped privately, so they're ours to window and drop */
+    frameDiffs.buf = motion->frameDiffs;
+    frameDiffs.bufsz = frameDiffs.bufused = frameCount;
+    if (windowSize == 0) windowSize = opts->fps / 3;
+    if (windowSize > 1)
+        calcWindow(&frameDiffs, windowSize, opts->windowKernel);
+
+    mkFrameTable(&frameTable, &frameDiffs);
+    sortFrameTable(&frameTable);
+    SF(frameSelections, calloc, NULL, (frameCount ? frameCount : 1, 1));
+    dropFramesf(frameSelections, &frameTable, dropFrames, opts->clipshowDivisor);
+    freeFrameTable(&frameTable);
 
-    INIT_BUFFER(frameDiffs);
-    READ_FILE_BUFFER(frameDiffs, stdin);
+    if (opts->export) {
+        /* the diffs are spent, so they can hold the selection */
+        for (i = 0; i < frameCount; i++)
+            motion->frameDiffs[i] = !frameSelections[i];
+        free(frameSelections);
+        return exportSeries(motion->frameDiffs, frameCount, opts);
+    }
+
+    /* find the runs of kept and dropped frames */
+    kept = runs = 0;
+    for (i = runStart = 0; i < frameCount; i++) {
+        if (!frameSelections[i]) kept++;
+        if (i + 1 < frameCount && frameSelections[i + 1] == frameSelections[i])
+            continue;
 
-    for (i = 0; i < frameDiffs.bufused; i++) {
-        printf("%f\n", frameDiffs.buf[i]);
+        if (frameSelections[i]) {
+            if (i + 1 - runStart > longestDropped) {
+                longestDropped = i + 1 - runStart;
+                longestDroppedAt = runStart;
+            }
+        } else {
+            runs++;
+            if (i + 1 - runStart > longestKept) {
+                longestKept = i + 1 - runStart;
+                longestKeptAt = runStart;
+            }
+        }
+        runStart = i + 1;
     }
 
+    printf("frames: %llu\n", frameCount);
+    printf("kept: %llu (%.2fx)\n", kept, kept ? (double) frameCount / kept : 0);
+    printf("dropped: %llu\n", frameCount - kept);
+    printf("duration: %.3f seconds at %d fps, from %.3f\n", (double) kept / opts->fps,
+           opts->fps, (double) frameCount / opts->fps);
+    printf("kept runs: %llu\n", runs);
+    if (longestKept)
+        printf("longest kept run: %llu frames from frame %llu\n", longestKept, longestKeptAt);
+    if (longestDropped)
+        printf("longest dropped run: %llu frames from frame %llu\n", longestDropped,
+               longestDroppedAt);
+
+    free(frameSelections);
     return 0;
 }
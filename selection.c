@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "helpers.h"
+#include "selection.h"
+
+/* a compensated running sum, so long runs of adds and subtracts don't drift */
+struct RunningSum {
+    double sum, c;
+};
+
+static int frameTableCmp(struct FrameTable *table, unsigned long long l,
+                         unsigned long long r);
+static void frameTableHeapUp(struct FrameTable *table, unsigned long long pos);
+static void frameTableHeapDown(struct FrameTable *table, unsigned long long ct,
+                               unsigned long long pos);
+static void runningSumAdd(struct RunningSum *rs, double val);
+static unsigned long long nextKeptFrame(unsigned long long *nextKept,
+                                        unsigned long long frame);
+
+/* compare these frames by diff, then by frame number */
+static int frameTableCmp(struct FrameTable *table, unsigned long long l,
+                         unsigned long long r)
+{
+    double ld = table->frameDiff[l], rd = table->frameDiff[r];
+    if (ld == rd) {
+        if (l > r) return 1;
+        else if (l < r) return -1;
+        else return 0;
+    } else {
+        if (ld > rd) return 1;
+        else if (ld < rd) return -1;
+        else return 0;
+    }
+}
+
+/* move this element of the frame table's heap up to its place */
+static void frameTableHeapUp(struct FrameTable *table, unsigned long long pos)
+{
+    unsigned long long *heap = table->heap;
+    unsigned long long el = heap[pos];
+
+    while (pos > 0) {
+        unsigned long long parent = (pos - 1) / 2;
+        if (frameTableCmp(table, heap[parent], el) <= 0) break;
+        heap[pos] = heap[parent];
+        table->heapPos[heap[pos]] = pos;
+        pos = parent;
+    }
+    heap[pos] = el;
+    table->heapPos[el] = pos;
+}
+
+/* move this element of the frame table's heap down to its place */
+static void frameTableHeapDown(struct FrameTable *table, unsigned long long ct,
+                               unsigned long long pos)
+{
+    unsigned long long *heap = table->heap;
+    unsigned long long el = heap[pos];
+
+    while (1) {
+        unsigned long long child = pos * 2 + 1;
+        if (child >= ct) break;
+        if (child + 1 < ct && frameTableCmp(table, heap[child + 1], heap[child]) < 0)
+            child++;
+        if (frameTableCmp(table, el, heap[child]) <= 0) break;
+        heap[pos] = heap[child];
+        table->heapPos[heap[pos]] = pos;
+        pos = child;
+    }
+    heap[pos] = el;
+    table->heapPos[el] = pos;
+}
+
+/* add to a running sum (Neumaier's compensated summation) */
+static void runningSumAdd(struct RunningSum *rs, double val)
+{
+    double t = rs->sum + val;
+    if (fabs(rs->sum) >= fabs(val))
+        rs->c += (rs->sum - t) + val;
+    else
+        rs->c += (val - t) + rs->sum;
+    rs->sum = t;
+}
+
+/* calculate frame windows in one pass. The window ending at frame i is kept as
+ * a running sum; the triangle is a running sum too, since each step adds w
+ * times the new frame and takes one of every frame in the last box away:
+ *     T[i] = T[i-1] - S[i-1] + w d[i]
+ * A ring of the last windowSize unwindowed diffs lets us do this in place. */
+void calcWindow(struct Buffer_double *frameDiffs, int windowSize,
+                enum WindowKernel windowKernel)
+{
+    struct RunningSum box = {0, 0}, tri = {0, 0};
+    double decay = 1.0 - 1.0 / windowSize, expSum = 0;
+    double *ring;
+    size_t i;
+
+    SF(ring, calloc, NULL, (windowSize, sizeof(double)));
+
+    for (i = 0; i < frameDiffs->bufused; i++) {
+        double val = frameDiffs->buf[i];
+        double old = ring[i % windowSize];
+        ring[i % windowSize] = val;
+
+        switch (windowKernel) {
+            case WINDOW_BOX:
+                runningSumAdd(&box, val);
+                runningSumAdd(&box, -old);
+                frameDiffs->buf[i] = box.sum + box.c;
+                break;
+
+            case WINDOW_TRIANGLE:
+                runningSumAdd(&tri, -(box.sum + box.c));
+                runningSumAdd(&tri, windowSize * val);
+                runningSumAdd(&box, val);
+                runningSumAdd(&box, -old);
+                /* scale to the same total weight as the box */
+                frameDiffs->buf[i] = (tri.sum + tri.c) * 2 / (windowSize + 1);
+                break;
+
+            case WINDOW_EXPONENTIAL:
+                expSum = val + decay * expSum;
+                frameDiffs->buf[i] = expSum;
+                break;
+        }
+    }
+
+    free(ring);
+}
+
+/* turn frame differences into a table of frames. The table takes over
+ * frameDiffs' buffer, since dropping frames adjusts the diffs. */
+void mkFrameTable(struct FrameTable *table, struct Buffer_double *frameDiffs)
+{
+    unsigned long long i;
+
+    table->count = frameDiffs->bufused;
+    table->frameDiff = frameDiffs->buf;
+    SF(table->heapPos, malloc, NULL, (sizeof(unsigned long long) * (table->count + 1)));
+    SF(table->heap, malloc, NULL, (sizeof(unsigned long long) * (table->count + 1)));
+    for (i = 0; i < table->count; i++) {
+        /* -0 must sort with 0, as it compares equal */
+        table->frameDiff[i] += 0.0;
+        table->heap[i] = i;
+    }
+}
+
+/* sort the frame table's heap by (diff, frame number), with an LSD radix sort
+ * on the diffs' bits. The sort is stable and the frames start in order, so
+ * equal diffs stay in frame order. */
+#define RADIX_BITS 11
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES ((64 + RADIX_BITS - 1) / RADIX_BITS)
+void sortFrameTable(struct FrameTable *table)
+{
+    unsigned long long count = table->count;
+    unsigned long long *keys, *keysOut, *frames, *framesOut, *tmp;
+    unsigned long long (*counts)[RADIX_SIZE];
+    unsigned long long i;
+    int pass;
+
+    SF(keys, malloc, NULL, (sizeof(unsigned long long) * (count + 1)));
+    SF(keysOut, malloc, NULL, (sizeof(unsigned long long) * (count + 1)));
+    SF(counts, calloc, NULL, (RADIX_PASSES, sizeof(*counts)));
+    frames = table->heap;
+    framesOut = table->heapPos; /* scratch until the heap is built */
+
+    /* map the doubles to integers with the same order, and count every digit
+     * in one go */
+    for (i = 0; i < count; i++) {
+        unsigned long long key;
+        memcpy(&key, &table->frameDiff[i], sizeof(key));
+        if (key >> 63) key = ~key;
+        else key |= 1ULL << 63;
+        keys[i] = key;
+        for (pass = 0; pass < RADIX_PASSES; pass++)
+            counts[pass][(key >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1)]++;
+    }
+
+    for (pass = 0; pass < RADIX_PASSES; pass++) {
+        unsigned long long *passCounts = counts[pass];
+        unsigned long long sum = 0;
+        int shift = pass * RADIX_BITS;
+
+        /* if every key has the same digit, this pass wouldn't move anything */
+        if (count && passCounts[(keys[0] >> shift) & (RADIX_SIZE - 1)] == count)
+            continue;
+
+        for (i = 0; i < RADIX_SIZE; i++) {
+            unsigned long long ct = passCounts[i];
+            passCounts[i] = sum;
+            sum += ct;
+        }
+
+        for (i = 0; i < count; i++) {
+            unsigned long long to = passCounts[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+            keysOut[to] = keys[i];
+            framesOut[to] = frames[i];
+        }
+
+        tmp = keys; keys = keysOut; keysOut = tmp;
+        tmp = frames; frames = framesOut; framesOut = tmp;
+    }
+
+    table->heap = frames;
+    table->heapPos = framesOut;
+
+    free(counts);
+    free(keysOut);
+    free(keys);
+}
+
+/* free the frame table (but not the diffs, which belong to the buffer) */
+void freeFrameTable(struct FrameTable *table)
+{
+    free(table->heapPos);
+    free(table->heap);
+}
+
+/* find the first kept frame at or after this one. nextKept is a union-find
+ * forest over frame numbers: a kept frame is its own root, and a dropped frame
+ * points further on. Paths are halved as they're walked. */
+static unsigned long long nextKeptFrame(unsigned long long *nextKept,
+                                        unsigned long long frame)
+{
+    while (nextKept[frame] != frame) {
+        nextKept[frame] = nextKept[nextKept[frame]];
+        frame = nextKept[frame];
+    }
+    return frame;
+}
+
+/* drop frames. The table's heap must be sorted, which also makes it a valid
+ * heap; it's used as a heap from then on, so each drop costs O(log n). */
+void dropFramesf(unsigned char *frameSelections, struct FrameTable *table,
+                 unsigned long long dropFrames, double clipshowDivisor)
+{
+    unsigned long long frameCount = table->count;
+    unsigned long long i, heapCt = frameCount, *nextKept;
+
+    /* frameCount is a sentinel, always "kept" */
+    SF(nextKept, malloc, NULL, (sizeof(unsigned long long) * (frameCount + 1)));
+    for (i = 0; i <= frameCount; i++)
+        nextKept[i] = i;
+
+    for (i = 0; i < frameCount; i++)
+        table->heapPos[table->heap[i]] = i;
+
+    for (i = 0; i < dropFrames && heapCt; i++) {
+        unsigned long long frame, nFrame;
+        if (i % 100 == 0)
+            fprintf(stderr, "Dropping frames: %llu/%llu\r", i, dropFrames);
+
+        /* drop the least frame */
+        frame = table->heap[0];
+        frameSelections[frame] = 1;
+        nextKept[frame] = frame + 1;
+        table->heap[0] = table->heap[--heapCt];
+        table->heap[heapCt] = frame;
+        if (heapCt) frameTableHeapDown(table, heapCt, 0);
+
+        /* find the next unskipped frame */
+        nFrame = nextKeptFrame(nextKept, frame + 1);
+
+        if (nFrame < frameCount && clipshowDivisor != 0) {
+            /* change it, and move it to its new place */
+            table->frameDiff[nFrame] += table->frameDiff[frame] / clipshowDivisor;
+            frameTableHeapUp(table, table->heapPos[nFrame]);
+            frameTableHeapDown(table, heapCt, table->heapPos[nFrame]);
+        }
+    }
+    fprintf(stderr, "\n");
+
+    free(nextKept);
+}
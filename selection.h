@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SELECTION_H
+#define SELECTION_H
+
+#include "buffer.h"
+
+/* Choosing which frames to drop: the motion diffs are windowed, sorted, and
+ * then the least are dropped one by one, each adding its motion to the next
+ * kept frame. */
+
+BUFFER(double, double);
+
+/* shapes of motion window */
+enum WindowKernel {
+    WINDOW_BOX,
+    WINDOW_TRIANGLE,
+    WINDOW_EXPONENTIAL
+};
+
+/* the frames being considered for dropping, as parallel arrays indexed by
+ * frame number, plus the frame numbers in drop order */
+struct FrameTable {
+    unsigned long long count;
+    double *frameDiff;
+    unsigned long long *heapPos; /* index of each frame in heap */
+    unsigned long long *heap; /* frame numbers, sorted, then used as a heap */
+};
+
+/* window the frame diffs in place, so that each is the sum of the windowSize
+ * frames ending with it, weighted by windowKernel */
+void calcWindow(struct Buffer_double *frameDiffs, int windowSize,
+                enum WindowKernel windowKernel);
+
+/* turn frame differences into a table of frames. The table takes over
+ * frameDiffs' buffer. */
+void mkFrameTable(struct FrameTable *table, struct Buffer_double *frameDiffs);
+
+/* sort the frame table by (diff, frame number) */
+void sortFrameTable(struct FrameTable *table);
+
+/* free the frame table (but not the diffs, which belong to the buffer) */
+void freeFrameTable(struct FrameTable *table);
+
+/* mark the dropFrames least frames of a sorted table as dropped in
+ * frameSelections, each dropped frame adding its diff over clipshowDivisor to
+ * the next kept frame */
+void dropFramesf(unsigned char *frameSelections, struct FrameTable *table,
+                 unsigned long long dropFrames, double clipshowDivisor);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE /* for MAP_ANONYMOUS */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "helpers.h"
+#include "stats.h"
+
+static const char *stageNames[STATS_STAGES] = {
+    "analyze", "window", "sort", "drop", "video", "audio", "mux"
+};
+
+static unsigned long long statsClock(clockid_t clock);
+static void writeString(FILE *out, const char *str);
+
+/* make a set of statistics in shared memory */
+struct StageStats *newStats()
+{
+    void *map;
+
+    SF(map, mmap, MAP_FAILED, (NULL, STATS_STAGES * sizeof(struct StageStats),
+                               PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0));
+    memset(map, 0, STATS_STAGES * sizeof(struct StageStats));
+    return (struct StageStats *) map;
+}
+
+/* free them */
+void freeStats(struct StageStats *stats)
+{
+    munmap(stats, STATS_STAGES * sizeof(struct StageStats));
+}
+
+/* the statistics for this stage */
+struct StageStats *statsStage(struct StageStats *stats, enum StatsStage stage)
+{
+    return stats ? &stats[stage] : NULL;
+}
+
+/* the monotonic time in nanoseconds */
+unsigned long long statsNow()
+{
+    return statsClock(CLOCK_MONOTONIC);
+}
+
+/* start timing a stage. Start and stop subtract and add the same clocks, so
+ * only the difference (modulo 2^64) remains. Threads and children add to the
+ * CPU times meanwhile, so those are changed atomically. */
+void statsStart(struct StageStats *stats)
+{
+    if (!stats) return;
+    stats->used = 1;
+    stats->wall -= statsNow();
+    STATS_ADD(stats, cpu, -statsClock(CLOCK_THREAD_CPUTIME_ID));
+}
+
+/* and stop */
+void statsStop(struct StageStats *stats)
+{
+    if (!stats) return;
+    stats->wall += statsNow();
+    STATS_ADD(stats, cpu, statsClock(CLOCK_THREAD_CPUTIME_ID));
+}
+
+/* add this thread's CPU time. A new thread's, like a forked child's, starts
+ * at 0. */
+void statsThreadDone(struct StageStats *stats)
+{
+    STATS_ADD(stats, cpu, statsClock(CLOCK_THREAD_CPUTIME_ID));
+}
+
+/* add a child's CPU time, which includes that of any children it waited for */
+void statsChildDone(struct StageStats *stats, const struct rusage *usage)
+{
+    STATS_ADD(stats, childCpu,
+              (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000000ULL +
+              (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) * 1000ULL);
+}
+
+/* write the JSON report. The total wall time adds up the stages run one after
+ * another. */
+int writeStats(struct StageStats *stats, FILE *out, const char *inputFile,
+               const char *outputFile, unsigned long long frames,
+               unsigned long long keptFrames, int failed)
+{
+    unsigned long long wall = 0, cpu = 0;
+    int i, first = 1;
+
+    if (!stats) return -1;
+
+    for (i = 0; i < STATS_STAGES; i++) {
+        /* but the output stages overlap, so count the longer of them */
+        if (i == STATS_AUDIO) {
+            if (stats[i].wall > stats[STATS_VIDEO].wall)
+                wall += stats[i].wall - stats[STATS_VIDEO].wall;
+        } else {
+            wall += stats[i].wall;
+        }
+        cpu += stats[i].cpu + stats[i].childCpu;
+    }
+
+    fprintf(out, "{\n  \"input\": ");
+    writeString(out, inputFile);
+    fprintf(out, ",\n  \"output\": ");
+    writeString(out, outputFile);
+    fprintf(out, ",\n  \"failed\": %s,\n", failed ? "true" : "false");
+    fprintf(out, "  \"frames\": %llu,\n  \"keptFrames\": %llu,\n", frames, keptFrames);
+    fprintf(out, "  \"wallSeconds\": %.6f,\n  \"cpuSeconds\": %.6f,\n", wall / 1e9, cpu / 1e9);
+    fprintf(out, "  \"stages\": {");
+
+    for (i = 0; i < STATS_STAGES; i++) {
+        struct StageStats *s = &stats[i];
+        if (!s->used) continue;
+        fprintf(out, "%s\n    \"%s\": {\n", first ? "" : ",", stageNames[i]);
+        fprintf(out, "      \"wallSeconds\": %.6f,\n", s->wall / 1e9);
+        fprintf(out, "      \"cpuSeconds\": %.6f,\n", s->cpu / 1e9);
+        fprintf(out, "      \"childCpuSeconds\": %.6f,\n", s->childCpu / 1e9);
+        fprintf(out, "      \"frames\": %llu,\n", s->frames);
+        fprintf(out, "      \"framesPerSecond\": %.3f,\n",
+                s->wall ? s->frames / (s->wall / 1e9) : 0.0);
+        fprintf(out, "      \"bytesIn\": %llu,\n", s->bytesIn);
+        fprintf(out, "      \"bytesOut\": %llu,\n", s->bytesOut);
+        fprintf(out, "      \"readBlockedSeconds\": %.6f,\n", s->readBlocked / 1e9);
+        fprintf(out, "      \"writeBlockedSeconds\": %.6f\n", s->writeBlocked / 1e9);
+        fprintf(out, "    }");
+        first = 0;
+    }
+
+    fprintf(out, "\n  }\n}\n");
+    return ferror(out) ? -1 : 0;
+}
+
+/* a clock in nanoseconds */
+static unsigned long long statsClock(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* write a JSON string */
+static void writeString(FILE *out, const char *str)
+{
+    const unsigned char *c;
+
+    if (!str) {
+        fprintf(out, "null");
+        return;
+    }
+
+    fputc('"', out);
+    for (c = (const unsigned char *) str; *c; c++) {
+        if (*c == '"' || *c == '\\') fprintf(out, "\\%c", *c);
+        else if (*c < 0x20) fprintf(out, "\\u%04x", *c);
+        else fputc(*c, out);
+    }
+    fputc('"', out);
+}
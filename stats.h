@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/* Timing and throughput statistics for each stage of a run. They're kept in
+ * memory shared with forked children, so the output stages and their chunks
+ * can add to them, and counters are added to atomically, so threads can too.
+ * Times are in nanoseconds. CPU times are only ever taken from the job's own
+ * threads and children, as other jobs may be running in the same process. */
+
+struct rusage;
+
+enum StatsStage {
+    STATS_ANALYZE,
+    STATS_WINDOW,
+    STATS_SORT,
+    STATS_DROP,
+    STATS_VIDEO,
+    STATS_AUDIO,
+    STATS_MUX,
+    STATS_STAGES
+};
+
+struct StageStats {
+    int used;
+    unsigned long long wall, cpu; /* cpu is of the stage's own threads */
+    unsigned long long childCpu; /* of the children it waited for, i.e. ffmpeg */
+    unsigned long long frames, bytesIn, bytesOut;
+    unsigned long long readBlocked, writeBlocked; /* in reads and writes of pipes */
+};
+
+/* make a set of statistics, shared with children forked from now on */
+struct StageStats *newStats();
+
+/* free them */
+void freeStats(struct StageStats *stats);
+
+/* the statistics for this stage, or NULL if stats is NULL */
+struct StageStats *statsStage(struct StageStats *stats, enum StatsStage stage);
+
+/* the monotonic time */
+unsigned long long statsNow();
+
+/* time a stage from start to stop in one thread. Either may be given NULL. */
+void statsStart(struct StageStats *stats);
+void statsStop(struct StageStats *stats);
+
+/* add the CPU time of the calling thread, as a thread or forked process that
+ * was started for the stage finishes. stats may be NULL. */
+void statsThreadDone(struct StageStats *stats);
+
+/* add the CPU time of a child, as wait4 gave it. stats may be NULL. */
+void statsChildDone(struct StageStats *stats, const struct rusage *usage);
+
+/* add to a counter */
+#define STATS_ADD(stats, field, n) do { \
+    if (stats) __atomic_add_fetch(&(stats)->field, (n), __ATOMIC_RELAXED); \
+} while (0)
+
+/* add the time since a statsNow() to a counter */
+#define STATS_SINCE(stats, field, since) STATS_ADD(stats, field, statsNow() - (since))
+
+/* write a JSON report of the statistics. Returns -1 on error. */
+int writeStats(struct StageStats *stats, FILE *out, const char *inputFile,
+               const char *outputFile, unsigned long long frames,
+               unsigned long long keptFrames, int failed);
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stretch.h"
+
+/* Output is built from 20ms frames overlapped by half. Each frame is taken
+ * from within 5ms of where the time map puts it, wherever it best continues
+ * the previous frame. The search is first over every STRETCH_DECIMATE'th
+ * offset, then refined around the best. */
+#define STRETCH_FRAME 0.02
+#define STRETCH_SEEK 0.005
+#define STRETCH_DECIMATE 4
+#define STRETCH_READ 4096 /* samples per read */
+
+/* the input, a sliding window of it as float samples */
+struct StretchInput {
+    int fd, channels;
+    float *buf; /* interleaved */
+    long long start; /* sample number of buf[0] */
+    size_t count, size; /* in samples (of all channels) */
+    long long readPos; /* sample number of the next sample from fd */
+    unsigned char *raw; /* bytes read but not yet converted */
+    size_t rawUsed, rawSize;
+    int eof;
+    struct StageStats *stats;
+};
+
+static int inputFill(struct StretchInput *in, long long upTo);
+static void inputDiscard(struct StretchInput *in, long long before);
+static float inputMono(struct StretchInput *in, long long pos);
+static double stretchCorrelation(struct StretchInput *in, const float *tmpl,
+                                 long long pos, int len, int step);
+static long long stretchSeek(struct StretchInput *in, const float *tmpl, int len,
+                             long long ideal, int seek);
+static int writeAll(int fd, const void *buf, size_t len, struct StageStats *stats);
+
+/* stretch PCM from in to out following the time map */
+int timeStretch(int in, int out, int rate, int channels,
+                const struct StretchPoint *map, size_t mapLen, struct StageStats *stats)
+{
+    struct StretchInput input;
+    int frame = ((int) (rate * STRETCH_FRAME)) & ~1;
+    int hop = frame / 2, seek = rate * STRETCH_SEEK;
+    float *window, *acc, *tmpl;
+    int16_t *outBuf;
+    long long outTotal, k, ideal, pos, prevPos = -1, emit;
+    size_t seg = 0;
+    int i, c, ret = -1;
+
+    if (mapLen == 0) return 0;
+    outTotal = llround(map[mapLen - 1].out * rate);
+
+    memset(&input, 0, sizeof(input));
+    input.fd = in;
+    input.channels = channels;
+    input.stats = stats;
+    input.rawSize = STRETCH_READ * channels * sizeof(int16_t);
+    SF(input.raw, malloc, NULL, (input.rawSize));
+
+    SF(window, malloc, NULL, (frame * sizeof(float)));
+    SF(acc, calloc, NULL, (frame * channels, sizeof(float)));
+    SF(tmpl, malloc, NULL, (hop * sizeof(float)));
+    SF(outBuf, malloc, NULL, (hop * channels * sizeof(int16_t)));
+
+    /* a periodic Hann window, which sums to exactly 1 when overlapped by half */
+    for (i = 0; i < frame; i++)
+        window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / frame);
+
+    for (k = 0; k * hop < outTotal; k++) {
+        double tOut = (double) k * hop / rate;
+        struct StretchPoint from = {0, 0}, to;
+
+        /* where the map puts this frame */
+        while (seg < mapLen - 1 && map[seg].out <= tOut) seg++;
+        if (seg > 0) from = map[seg - 1];
+        to = map[seg];
+        if (to.out > from.out)
+            ideal = llround((from.in + (tOut - from.out) * (to.in - from.in) / (to.out - from.out)) * rate);
+        else
+            ideal = llround(to.in * rate);
+
+        if (prevPos < 0) {
+            pos = ideal;
+            inputDiscard(&input, pos);
+        } else {
+            /* the natural continuation of the last frame is what we match */
+            long long natural = prevPos + hop;
+            if (inputFill(&input, natural + hop) < 0) goto done;
+            for (i = 0; i < hop; i++)
+                tmpl[i] = inputMono(&input, natural + i);
+
+            inputDiscard(&input, ideal - seek);
+            if (inputFill(&input, ideal + seek + frame) < 0) goto done;
+            pos = stretchSeek(&input, tmpl, hop, ideal, seek);
+        }
+
+        /* overlap-add this frame */
+        if (inputFill(&input, pos + frame) < 0) goto done;
+        for (i = 0; i < frame; i++) {
+            long long at = pos + i - input.start;
+            if (at < 0 || at >= (long long) input.count) continue;
+            for (c = 0; c < channels; c++)
+                acc[i * channels + c] += window[i] * input.buf[at * channels + c];
+        }
+
+        /* the first hop of output is now finished */
+        emit = outTotal - k * hop;
+        if (emit > hop) emit = hop;
+        for (i = 0; i < emit * channels; i++) {
+            float s = acc[i];
+            outBuf[i] = (s >= 32767) ? 32767 : (s <= -32768) ? -32768 : lrintf(s);
+        }
+        if (writeAll(out, outBuf, emit * channels * sizeof(int16_t), stats) < 0) goto done;
+        memmove(acc, acc + hop * channels, (frame - hop) * channels * sizeof(float));
+        memset(acc + (frame - hop) * channels, 0, hop * channels * sizeof(float));
+
+        prevPos = pos;
+    }
+    ret = 0;
+
+done:
+    free(outBuf);
+    free(tmpl);
+    free(acc);
+    free(window);
+    free(input.buf);
+    free(input.raw);
+    return ret;
+}
+
+/* read input until we have everything before upTo, or it ends */
+static int inputFill(struct StretchInput *in, long long upTo)
+{
+    int channels = in->channels;
+    size_t frameBytes = channels * sizeof(int16_t), frames, i;
+    ssize_t rd;
+    unsigned long long since;
+
+    while (!in->eof && in->start + (long long) (in->count / channels) < upTo) {
+        if (in->count + STRETCH_READ * channels > in->size) {
+            in->size = in->size ? in->size * 2 : STRETCH_READ * channels * 4;
+            SF(in->buf, realloc, NULL, (in->buf, in->size * sizeof(float)));
+        }
+
+        since = statsNow();
+        rd = read(in->fd, in->raw + in->rawUsed, in->rawSize - in->rawUsed);
+        STATS_SINCE(in->stats, readBlocked, since);
+        if (rd < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (rd == 0) {
+            in->eof = 1;
+            break;
+        }
+        in->rawUsed += rd;
+        STATS_ADD(in->stats, bytesIn, rd);
+
+        /* convert whole samples, dropping any we've been told to skip */
+        frames = in->rawUsed / frameBytes;
+        for (i = 0; i < frames; i++, in->readPos++) {
+            int16_t s;
+            int c;
+            if (in->readPos < in->start) continue;
+            for (c = 0; c < channels; c++) {
+                memcpy(&s, in->raw + i * frameBytes + c * sizeof(int16_t), sizeof(s));
+                in->buf[in->count++] = s;
+            }
+        }
+        in->rawUsed -= frames * frameBytes;
+        memmove(in->raw, in->raw + frames * frameBytes, in->rawUsed);
+    }
+
+    return 0;
+}
+
+/* forget input before this sample, skipping it if it hasn't been read yet */
+static void inputDiscard(struct StretchInput *in, long long before)
+{
+    long long have = in->count / in->channels;
+    long long drop = before - in->start;
+
+    if (drop <= 0) return;
+    if (drop >= have) {
+        in->count = 0;
+        in->start = before;
+        return;
+    }
+
+    /* only move the rest down once it's worth it */
+    if (drop * 2 < have) return;
+    memmove(in->buf, in->buf + drop * in->channels,
+            (have - drop) * in->channels * sizeof(float));
+    in->count -= drop * in->channels;
+    in->start = before;
+}
+
+/* the sum of all channels at this sample, or 0 if we don't have it */
+static float inputMono(struct StretchInput *in, long long pos)
+{
+    long long at = pos - in->start;
+    float sum = 0;
+    int c;
+
+    if (at < 0 || at >= (long long) (in->count / in->channels)) return 0;
+    for (c = 0; c < in->channels; c++)
+        sum += in->buf[at * in->channels + c];
+    return sum;
+}
+
+/* how well the input at pos matches the template, normalized by the input's
+ * energy so that loud passages aren't favored */
+static double stretchCorrelation(struct StretchInput *in, const float *tmpl,
+                                 long long pos, int len, int step)
+{
+    double xy = 0, yy = 0;
+    int i;
+
+    for (i = 0; i < len; i += step) {
+        double y = inputMono(in, pos + i);
+        xy += tmpl[i] * y;
+        yy += y * y;
+    }
+
+    return (yy > 0) ? xy / sqrt(yy) : 0;
+}
+
+/* find the position within seek of ideal that best matches the template */
+static long long stretchSeek(struct StretchInput *in, const float *tmpl, int len,
+                             long long ideal, int seek)
+{
+    long long lo = ideal - seek, hi = ideal + seek, pos, best = ideal, from, to;
+    double score, bestScore;
+
+    if (lo < in->start) lo = in->start;
+    if (best < lo) best = lo;
+    bestScore = stretchCorrelation(in, tmpl, best, len, STRETCH_DECIMATE);
+
+    /* coarse */
+    for (pos = lo; pos <= hi; pos += STRETCH_DECIMATE) {
+        score = stretchCorrelation(in, tmpl, pos, len, STRETCH_DECIMATE);
+        if (score > bestScore) {
+            bestScore = score;
+            best = pos;
+        }
+    }
+
+    /* then fine */
+    from = best - STRETCH_DECIMATE + 1;
+    to = best + STRETCH_DECIMATE - 1;
+    if (from < lo) from = lo;
+    if (to > hi) to = hi;
+    bestScore = stretchCorrelation(in, tmpl, best, len, 1);
+    for (pos = from; pos <= to; pos++) {
+        score = stretchCorrelation(in, tmpl, pos, len, 1);
+        if (score > bestScore) {
+            bestScore = score;
+            best = pos;
+        }
+    }
+
+    return best;
+}
+
+/* write all of this */
+static int writeAll(int fd, const void *buf, size_t len, struct StageStats *stats)
+{
+    const char *cbuf = (const char *) buf;
+    ssize_t wr;
+    unsigned long long since;
+
+    while (len) {
+        since = statsNow();
+        wr = write(fd, cbuf, len);
+        STATS_SINCE(stats, writeBlocked, since);
+        if (wr < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        STATS_ADD(stats, bytesOut, wr);
+        cbuf += wr;
+        len -= wr;
+    }
+
+    return 0;
+}
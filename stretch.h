@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2014 Gregor Richards
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef STRETCH_H
+#define STRETCH_H
+
+#include <stddef.h>
+
+#include "buffer.h"
+#include "stats.h"
+
+/* The time map of a stretch, as the cumulative input and output times (in
+ * seconds) at the end of each piece. Within a piece, time is stretched
+ * uniformly. */
+struct StretchPoint {
+    double in, out;
+};
+
+BUFFER(stretchPoint, struct StretchPoint);
+
+/* Stretch interleaved signed 16-bit native-endian PCM read from the fd in,
+ * writing it to the fd out. It's stretched by WSOLA (waveform similarity
+ * overlap-add), which changes tempo without changing pitch. Output stops at
+ * the end of the map, padded with silence if the input ends first. The bytes
+ * read and written, and time blocked doing so, are added to stats if it isn't
+ * NULL. Returns -1 (with errno set) on an I/O error. */
+int timeStretch(int in, int out, int rate, int channels,
+                const struct StretchPoint *map, size_t mapLen, struct StageStats *stats);
+
+#endif